@@ -96,6 +96,7 @@ rm -rf %{buildroot}
 
 %dir %{_datadir}/booth
 %{_datadir}/booth/service-runnable
+%{_datadir}/booth/ticket-helper
 
 %doc README COPYING
 
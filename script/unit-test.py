@@ -162,6 +162,9 @@ class UT():
     # We want shorthand in descriptions, ie. "state"
     # instead of "booth_conf->ticket[0].state".
     def translate_shorthand(self, name, context):
+        # globals are taken as they are
+        if re.match(r"^(booth_conf->|local->|ticket_stats\.)", name):
+            return name
         if context == 'ticket':
             return "booth_conf->ticket[0]." + name
         if context == 'message':
@@ -244,8 +247,8 @@ class UT():
         self.sync(2000)
 
         # Only stop for this recipient, so that broadcasts are not seen multiple times
-        self.send_cmd("break booth_udp_send if to == &(booth_conf->site[1])")
-        self.send_cmd("break recvfrom")
+        self.send_cmd("break udp_send_add if to == &(booth_conf->site[1])")
+        self.send_cmd("break deliver_datagram")
         # ticket_cron is still a breakpoint
 
         # Now we're set up.
@@ -409,23 +412,19 @@ class UT():
     def send_message(self, msg):
         self.udp_sock.sendto('a', (socket.gethostbyname(self.this_site), self.this_port))
 
-        self.wait_for_function("recvfrom")
-        # drain input, but stop afterwards for changing data
-        self.send_cmd("finish")
-        # step over length assignment
-        self.send_cmd("next")
-        
+        self.wait_for_function("deliver_datagram")
+
         # push message.
         for (n, v) in msg.iteritems():
             self.set_val( self.translate_shorthand(n, "message"), v, "htonl")
 
         # set "received" length
-        self.set_val("rv", "msg->header.length", "ntohl")
+        self.set_val("len", "msg->header.length", "ntohl")
 
         # the next thing should run continue via wait_for_function
  
     def wait_outgoing(self, msg):
-        self.wait_for_function("booth_udp_send")
+        self.wait_for_function("udp_send_add")
         ok = True
         for (n, v) in msg.iteritems():
             if re.search(r"\.", n):
@@ -40,18 +40,31 @@
 #define BOOTH_PATH_LEN		127
 
 #define BOOTH_DEFAULT_PORT		9929
+#define BOOTH_DEFAULT_UDP_BUFFER	160000
 
 /* TODO: remove */
 #define BOOTH_PROTO_FAMILY	AF_INET
 
 #define BOOTHC_MAGIC		0x5F1BA08C
 #define BOOTHC_VERSION		0x00010003
+/* Several tickets in one datagram, see struct boothc_multi_rec.
+ * Sent only to peers which set OPT_MULTI_RECORD. */
+#define BOOTHC_VERSION_MULTI	0x00010004
 
+/* Largest datagram we send; stay below the usual path MTU. */
+#define BOOTH_UDP_MAX_LEN	1400
 
-/** Timeout value for poll().
- * Determines frequency of periodic jobs, eg. when send-retries are done.
- * See process_tickets(). */
-#define POLL_TIMEOUT	100
+/* Probe a peer we haven't heard from for this long (in seconds), and
+ * take it as down after this much silence; see process_peer_timeouts(). */
+#define PEER_PROBE_INTERVAL	2
+#define PEER_DOWN_AFTER		6
+/* A peer we never heard from may run an older booth, which rejects
+ * (and logs) every probe; stop after this many until it talks to us. */
+#define PEER_PROBES_UNSEEN	3
+
+/* Lower bound for a peer's retransmission timeout, in milliseconds;
+ * the upper one is the ticket's "timeout". See ticket_activate_timeout(). */
+#define BOOTH_RTO_MIN_MS	50
 
 
 /** @{ */
@@ -129,17 +142,58 @@ struct boothc_ticket_msg {
 } __attribute__((packed));
 
 
+/** One ticket in a BOOTHC_VERSION_MULTI packet.
+ * The packet starts with a struct boothc_header, of which only
+ * magic, version, from, length, options and request matter; the
+ * records follow, as many as the length says.
+ * The header's request is the sender's booth_config.ticket_list_hash;
+ * if it matches the receiver's, both have the same tickets in the same
+ * order, and the sender may set OPT_TICKET_IDS in the header's options
+ * and use struct boothc_multi_id_rec instead. */
+struct boothc_multi_rec {
+	uint32_t cmd;
+	uint32_t request;
+	uint32_t options;
+	uint32_t reason;
+	uint32_t result;
+
+	struct ticket_msg ticket;
+} __attribute__((packed));
+
+
+/** Like struct boothc_multi_rec, but the ticket is given as its index
+ * in the configuration. */
+struct boothc_multi_id_rec {
+	uint32_t cmd;
+	uint32_t request;
+	uint32_t options;
+	uint32_t reason;
+	uint32_t result;
+
+	uint32_t ticket;
+	uint32_t leader;
+	uint32_t term;
+	uint32_t term_valid_for;
+} __attribute__((packed));
+
+
 typedef enum {
 	/* 0x43 = "C"ommands */
 	CMD_LIST    = CHAR2CONST('C', 'L', 's', 't'),
 	CMD_GRANT   = CHAR2CONST('C', 'G', 'n', 't'),
 	CMD_REVOKE  = CHAR2CONST('C', 'R', 'v', 'k'),
+	CMD_PEERS   = CHAR2CONST('C', 'P', 'e', 'r'),
+	CMD_STATS   = CHAR2CONST('C', 'S', 't', 's'),
+	CMD_MIGRATE = CHAR2CONST('C', 'M', 'i', 'g'),
 
 	/* Replies */
 	CMR_GENERAL = CHAR2CONST('G', 'n', 'l', 'R'), // Increase distance to CMR_GRANT
 	CMR_LIST    = CHAR2CONST('R', 'L', 's', 't'),
 	CMR_GRANT   = CHAR2CONST('R', 'G', 'n', 't'),
 	CMR_REVOKE  = CHAR2CONST('R', 'R', 'v', 'k'),
+	CMR_PEERS   = CHAR2CONST('R', 'P', 'e', 'r'),
+	CMR_STATS   = CHAR2CONST('R', 'S', 't', 's'),
+	CMR_MIGRATE = CHAR2CONST('R', 'M', 'i', 'g'),
 
 	/* get status from another server */
 	OP_STATUS   = CHAR2CONST('S', 't', 'a', 't'),
@@ -153,6 +207,16 @@ typedef enum {
 	OP_UPDATE   = CHAR2CONST('U', 'p', 'd', 'E'), /* Update ticket */
 	OP_REVOKE   = CHAR2CONST('R', 'e', 'v', 'k'), /* Revoke ticket */
 	OP_REJECTED = CHAR2CONST('R', 'J', 'C', '!'),
+	OP_PRE_VOTE = CHAR2CONST('P', 'V', 'o', 't'), /* would you vote for me? */
+	OP_PRE_VOTE_OK = CHAR2CONST('P', 'V', 'O', 'k'), /* yes, reply to PRE_VOTE */
+	OP_HANDOVER = CHAR2CONST('H', 'n', 'd', 'O'), /* leader gives the ticket away */
+	OP_TAKEOVER = CHAR2CONST('T', 'k', 'O', 'v'), /* ... and the new one may take it */
+	OP_COND_VOTE = CHAR2CONST('C', 'V', 'o', 't'), /* vote for me once the term expires */
+	OP_COND_VOTE_FOR = CHAR2CONST('C', 'V', 'F', 'r'), /* promised, reply to COND_VOTE */
+
+	/* site liveness; just a header, with BOOTHC_VERSION_MULTI */
+	OP_PING     = CHAR2CONST('P', 'i', 'n', 'g'),
+	OP_PONG     = CHAR2CONST('P', 'o', 'n', 'g'), /* reply to PING */
 } cmd_request_t;
 
 
@@ -172,6 +236,8 @@ typedef enum {
 	RLT_TERM_STILL_VALID    = CHAR2CONST('T', 'V', 'l', 'd'),
 	RLT_YOU_OUTDATED        = CHAR2CONST('O', 'u', 't', 'd'),
 	RLT_REDIRECT            = CHAR2CONST('R', 'e', 'd', 'r'),
+	/* internal only: the answer comes later, see client_wait() */
+	RLT_MORE                = CHAR2CONST('M', 'o', 'r', 'e'),
 } cmd_result_t;
 
 
@@ -187,16 +253,32 @@ typedef enum {
 	OR_SPLIT                = CHAR2CONST('S', 'p', 'l', 't'),
 } cmd_reason_t;
 
-/* bitwise command options, currently used only for immediate
- * grant */
+/* bitwise command options */
 typedef enum {
+	/* client: grant immediately */
 	OPT_IMMEDIATE = 1,
+	/* peers: the sender understands BOOTHC_VERSION_MULTI */
+	OPT_MULTI_RECORD = 2,
+	/* peers: tickets given by index, see boothc_multi_id_rec */
+	OPT_TICKET_IDS = 4,
 } cmd_options_t;
 
 /** @} */
 
 /** @{ */
 
+/** One word of a set of sites, see siteset.h. */
+typedef uint64_t siteset_word_t;
+#define SITESET_WORD_BITS	64
+
+/** Kinds of round trips, see booth_site.srtt. */
+typedef enum {
+	RTT_PLAIN = 0,
+	/* the peer writes the CIB before it answers (OP_UPDATE, OP_REVOKE) */
+	RTT_COMMIT,
+	RTT_KINDS,
+} rtt_kind_t;
+
 struct booth_site {
 	/** Calculated ID. See add_site(). */
 	int site_id;
@@ -211,9 +293,9 @@ struct booth_site {
 	int tcp_fd;
 	int udp_fd;
 
-	/* 0-based, used for indexing into per-ticket weights */
+	/* 0-based, used for indexing into per-ticket weights,
+	 * and into site sets (see siteset.h) */
 	int index;
-	uint64_t bitmask;
 
 	unsigned short family;
 	union {
@@ -222,6 +304,16 @@ struct booth_site {
 	};
 	int saddrlen;
 	int addrlen;
+
+	/** Liveness, shared by all tickets; see peer_heard(). */
+	time_t last_recv;
+	time_t last_probe;
+	int down;
+
+	/** Smoothed RTT and its variation in microseconds, 0 if not
+	 * known yet; see peer_rtt_sample(). */
+	int srtt[RTT_KINDS];
+	int rttvar[RTT_KINDS];
 } __attribute__((packed));
 
 
@@ -232,22 +324,55 @@ extern struct booth_site * no_leader;
 /** @} */
 
 struct booth_transport;
+struct ticket_config;
+
+/** State of a client connection, see process_connection(). */
+typedef enum {
+	CONN_HEADER = 0,	/* reading the header */
+	CONN_BODY,		/* reading the rest of the request */
+	CONN_WAIT,		/* waiting for the answer, see client_wait() */
+	CONN_REPLY,		/* writing the answer */
+	CONN_CLOSING,		/* answer sent, waiting for EOF */
+} conn_state_e;
 
 struct client {
 	int fd;
 	const struct booth_transport *transport;
 	void (*workfn)(int);
 	void (*deadfn)(int);
+	/* next unused slot, see client_add() */
+	int next_free;
+
+	/** \name Client connections only.
+	 * @{ */
+	conn_state_e state;
+	/** Request being read, and the number of bytes we have. */
+	struct boothc_ticket_msg *msg;
+	int offset;
+	/** Answer to be sent. */
+	char *out;
+	int out_len, out_pos;
+	/** When the connection gets dropped; see conn_touch(). */
+	time_t deadline;
+	int conn_prev, conn_next;
+	/** Ticket whose result is waited for (CONN_WAIT). */
+	struct ticket_config *wait_tk;
+	/** @} */
 };
 
 extern struct client *clients;
-extern struct pollfd *pollfds;
 
 
 int client_add(int fd, const struct booth_transport *tpt,
 		void (*workfn)(int ci), void (*deadfn)(int ci));
+void client_dead(int ci);
 int do_read(int fd, void *buf, size_t count);
 int do_write(int fd, void *buf, size_t count);
+int client_conn_start(int ci);
+int client_send(int ci, void *buf, int len);
+void client_wait(int ci, struct ticket_config *tk);
+int client_waiting_for(struct ticket_config *tk);
+void client_resume(int ci);
 void process_connection(int ci);
 void safe_copy(char *dest, char *value, size_t buflen, const char *description);
 
@@ -32,6 +32,7 @@
 #include "raft.h"
 #include "ticket.h"
 #include "log.h"
+#include "siteset.h"
 
 static int ticket_size = 0;
 
@@ -60,6 +61,171 @@ static int ticket_realloc(void)
 }
 
 
+/** \name Hash index of the ticket names.
+ * Open addressing with linear probing. The slots hold the index into
+ * booth_conf->ticket plus one (0 means empty), so ticket_realloc()
+ * doesn't invalidate them. The table is kept at most half full.
+ * @{ */
+
+/* FNV-1a */
+static uint32_t ticket_name_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static void ticket_hash_put(int *table, int size, int i)
+{
+	uint32_t h;
+
+	h = ticket_name_hash(booth_conf->ticket[i].name) & (size - 1);
+	while (table[h])
+		h = (h + 1) & (size - 1);
+	table[h] = i + 1;
+}
+
+
+/* Tickets 0 .. i-1 are in the index already. */
+static int ticket_hash_add(int i)
+{
+	int *table, size, j;
+
+	if ((i + 1) * 2 > booth_conf->ticket_hash_size) {
+		size = booth_conf->ticket_hash_size ?: 64;
+		while (size < (i + 1) * 2)
+			size *= 2;
+
+		table = calloc(size, sizeof(*table));
+		if (!table) {
+			log_error("out of memory for the ticket index");
+			return -ENOMEM;
+		}
+		for (j = 0; j < i; j++)
+			ticket_hash_put(table, size, j);
+
+		free(booth_conf->ticket_hash);
+		booth_conf->ticket_hash = table;
+		booth_conf->ticket_hash_size = size;
+	}
+
+	ticket_hash_put(booth_conf->ticket_hash,
+			booth_conf->ticket_hash_size, i);
+	return 0;
+}
+
+
+/** Returns the index of the ticket, or -1. */
+int ticket_hash_find(const char *name)
+{
+	int *table = booth_conf->ticket_hash;
+	int mask = booth_conf->ticket_hash_size - 1;
+	uint32_t h;
+	int i;
+
+	if (!table)
+		return -1;
+
+	h = ticket_name_hash(name) & mask;
+	while ((i = table[h])) {
+		if (!strcmp(booth_conf->ticket[i - 1].name, name))
+			return i - 1;
+		h = (h + 1) & mask;
+	}
+	return -1;
+}
+
+
+/* Over all names in order, including their terminating NULs. */
+static uint32_t ticket_list_hash(void)
+{
+	uint32_t h = 2166136261u;
+	const char *c;
+	int i;
+
+	for (i = 0; i < booth_conf->ticket_count; i++) {
+		c = booth_conf->ticket[i].name;
+		do {
+			h ^= (unsigned char)*c;
+			h *= 16777619u;
+		} while (*c++);
+	}
+	return h;
+}
+/** @} */
+
+
+/** \name Index of the sites by site_id.
+ * A perfect hash: the table size is chosen so that site_id % size is
+ * different for all sites; the slots hold the index into
+ * booth_conf->site plus one. If no size up to SITE_BY_ID_MAX works,
+ * there's no table, and find_site_by_id() just searches.
+ * @{ */
+
+#define SITE_BY_ID_MAX	4096
+
+static int site_by_id_build(void)
+{
+	int *table, size, i, slot;
+
+	free(booth_conf->site_by_id);
+	booth_conf->site_by_id = NULL;
+	booth_conf->site_by_id_size = 0;
+
+	table = calloc(SITE_BY_ID_MAX, sizeof(*table));
+	if (!table) {
+		log_error("out of memory for the site index");
+		return -ENOMEM;
+	}
+
+	for (size = booth_conf->site_count; size <= SITE_BY_ID_MAX; size++) {
+		memset(table, 0, size * sizeof(*table));
+		for (i = 0; i < booth_conf->site_count; i++) {
+			slot = booth_conf->site[i].site_id % size;
+			if (table[slot])
+				break;
+			table[slot] = i + 1;
+		}
+
+		if (i == booth_conf->site_count) {
+			booth_conf->site_by_id = table;
+			booth_conf->site_by_id_size = size;
+			return 0;
+		}
+	}
+
+	log_info("no perfect hash for the site IDs, using a linear search");
+	free(table);
+	return 0;
+}
+/** @} */
+
+
+/* The sites don't move after reading the configuration, so only
+ * pointers taken before then get invalid here. */
+static int site_realloc(void)
+{
+	int want;
+	void *p;
+
+	want = booth_conf->site_allocated + SITE_ALLOC;
+	p = realloc(booth_conf->site, sizeof(struct booth_site) * want);
+	if (!p) {
+		log_error("can't alloc more sites");
+		return -ENOMEM;
+	}
+
+	booth_conf->site = p;
+	booth_conf->site_allocated = want;
+	return 0;
+}
+
+
 int add_site(char *address, int type);
 int add_site(char *addr_string, int type)
 {
@@ -71,16 +237,19 @@ int add_site(char *addr_string, int type)
 
 
 	rv = 1;
-	if (booth_conf->site_count == MAX_NODES) {
-		log_error("too many nodes");
-		goto out;
-	}
 	if (strlen(addr_string)+1 >= sizeof(booth_conf->site[0].addr_string)) {
 		log_error("site address \"%s\" too long", addr_string);
 		goto out;
 	}
 
+	if (booth_conf->site_count == booth_conf->site_allocated) {
+		rv = site_realloc();
+		if (rv < 0)
+			goto out;
+	}
+
 	site = booth_conf->site + booth_conf->site_count;
+	memset(site, 0, sizeof(*site));
 
 	site->family = BOOTH_PROTO_FAMILY;
 	site->type = type;
@@ -90,13 +259,6 @@ int add_site(char *addr_string, int type)
 
 
 	site->index = booth_conf->site_count;
-	site->bitmask = 1 << booth_conf->site_count;
-	/* Catch site overflow */
-	assert(site->bitmask);
-	booth_conf->all_bits |= site->bitmask;
-	if (type == SITE)
-		booth_conf->sites_bits |= site->bitmask;
-
 	site->tcp_fd = -1;
 
 	booth_conf->site_count++;
@@ -154,6 +316,9 @@ int add_site(char *addr_string, int type)
 			exit(1);
 		}
 
+	if (!rv)
+		rv = site_by_id_build();
+
 out:
 	return rv;
 }
@@ -210,13 +375,6 @@ static int add_ticket(const char *name, struct ticket_config **tkp,
 	tk = booth_conf->ticket + booth_conf->ticket_count;
 	booth_conf->ticket_count++;
 
-	tk->last_valid_tk = malloc(sizeof(struct ticket_config));
-	if (!tk->last_valid_tk) {
-		log_error("out of memory");
-		return -ENOMEM;
-	}
-	memset(tk->last_valid_tk, 0, sizeof(struct ticket_config));
-
 	if (!check_max_len_valid(name, sizeof(tk->name))) {
 		log_error("ticket name \"%s\" too long.", name);
 		return -EINVAL;
@@ -233,10 +391,26 @@ static int add_ticket(const char *name, struct ticket_config **tkp,
 	}
 
 	strcpy(tk->name, name);
+	rv = ticket_hash_add(booth_conf->ticket_count - 1);
+	if (rv < 0)
+		return rv;
+
 	tk->timeout = def->timeout;
 	tk->term_duration = def->term_duration;
 	tk->retries = def->retries;
-	memcpy(tk->weight, def->weight, sizeof(tk->weight));
+	tk->ext_verifier_timeout = def->ext_verifier_timeout;
+	tk->ext_verifier_cache = def->ext_verifier_cache;
+	tk->ext_verifier_cache_shared = def->ext_verifier_cache_shared;
+	if (def->weight_count) {
+		tk->weight = malloc(def->weight_count * sizeof(*tk->weight));
+		if (!tk->weight) {
+			log_error("out of memory");
+			return -ENOMEM;
+		}
+		memcpy(tk->weight, def->weight,
+				def->weight_count * sizeof(*tk->weight));
+		tk->weight_count = def->weight_count;
+	}
 
 	if (tkp)
 		*tkp = tk;
@@ -256,13 +430,17 @@ static int validate_ticket(struct ticket_config *tk)
 	return 1;
 }
 
-/* returns number of weights, or -1 on bad input. */
-static int parse_weights(const char *input, int weights[MAX_NODES])
+/* Stores the weights in tk; returns their number, or -1 on bad input. */
+static int parse_weights(const char *input, struct ticket_config *tk)
 {
-	int i, v;
+	int i, v, *w;
 	char *cp;
 
-	for(i=0; i<MAX_NODES; i++) {
+	free(tk->weight);
+	tk->weight = NULL;
+	tk->weight_count = 0;
+
+	for(i=0; ; i++) {
 		/* End of input? */
 		if (*input == 0)
 			break;
@@ -273,7 +451,14 @@ static int parse_weights(const char *input, int weights[MAX_NODES])
 			return -1;
 		}
 
-		weights[i] = v;
+		w = realloc(tk->weight, (i+1) * sizeof(*w));
+		if (!w) {
+			log_error("out of memory");
+			return -1;
+		}
+		w[i] = v;
+		tk->weight = w;
+		tk->weight_count = i+1;
 
 		while (*cp) {
 			/* Separator characters */
@@ -293,13 +478,52 @@ static int parse_weights(const char *input, int weights[MAX_NODES])
 		input = cp;
 	}
 
+	return i;
+}
+
 
-	/* Fill rest of vector. */
-	for(v=i; v<MAX_NODES; v++) {
-		weights[v] = 0;
+/* Now that the number of sites is known, allocate the site sets
+ * and the per-site data of the tickets. */
+static int setup_sitesets(void)
+{
+	struct ticket_config *tk;
+	struct booth_site *site;
+	siteset_word_t *sets;
+	int i, words, n;
+
+	words = (booth_conf->site_count + SITESET_WORD_BITS - 1) /
+		SITESET_WORD_BITS;
+	if (!words)
+		words = 1;
+	booth_conf->siteset_words = words;
+
+	sets = calloc(2 * words, sizeof(*sets));
+	if (!sets)
+		goto oom;
+	booth_conf->sites_set = sets;
+	booth_conf->all_set = sets + words;
+	foreach_node(i, site) {
+		siteset_add(booth_conf->all_set, site);
+		if (site->type == SITE)
+			siteset_add(booth_conf->sites_set, site);
 	}
 
-	return i;
+	/* One block per ticket: votes_for, votes_received, acks_received. */
+	n = booth_conf->site_count;
+	foreach_ticket(i, tk) {
+		tk->votes_for = calloc(1, n * sizeof(*tk->votes_for) +
+				2 * words * sizeof(*sets));
+		if (!tk->votes_for)
+			goto oom;
+		tk->votes_received = (siteset_word_t *)(tk->votes_for + n);
+		tk->acks_received = tk->votes_received + words;
+	}
+
+	return 0;
+
+oom:
+	log_error("out of memory for the site sets");
+	return -ENOMEM;
 }
 
 
@@ -312,7 +536,7 @@ int read_config(const char *path, int type)
 	int i;
 	int lineno = 0;
 	int got_transport = 0;
-	struct ticket_config defaults = { { 0 } };
+	struct ticket_config defaults = { 0 };
 	struct ticket_config *current_tk = NULL;
 
 
@@ -335,6 +559,8 @@ int read_config(const char *path, int type)
 
 	booth_conf->proto = UDP;
 	booth_conf->port = BOOTH_DEFAULT_PORT;
+	booth_conf->udp_buffer_size = BOOTH_DEFAULT_UDP_BUFFER;
+	strcpy(booth_conf->ticket_handler, "pacemaker");
 
 
 	/* Provide safe defaults. -1 is reserved, though. */
@@ -345,7 +571,6 @@ int read_config(const char *path, int type)
 	strcpy(booth_conf->arb_user,   "nobody");
 	strcpy(booth_conf->arb_group,  "nobody");
 
-	parse_weights("", defaults.weight);
 	defaults.ext_verifier  = NULL;
 	defaults.term_duration        = DEFAULT_TICKET_EXPIRY;
 	defaults.timeout       = DEFAULT_TICKET_TIMEOUT;
@@ -466,6 +691,16 @@ no_value:
 			continue;
 		}
 
+		if (strcmp(key, "udp-buffer-size") == 0) {
+			booth_conf->udp_buffer_size = strtol(val, &s, 0);
+			if (*s || s == val ||
+					booth_conf->udp_buffer_size < BOOTH_UDP_MAX_LEN) {
+				error = "Expected plain integer value >=1400 for udp-buffer-size";
+				goto err;
+			}
+			continue;
+		}
+
 		if (strcmp(key, "name") == 0) {
 			safe_copy(booth_conf->name, 
 					val, BOOTH_NAME_LEN,
@@ -506,6 +741,27 @@ no_value:
 			continue;
 		}
 
+		if (strcmp(key, "ticket-handler") == 0) {
+			if (strcmp(val, "pacemaker") &&
+					strcmp(val, "file") &&
+					strcmp(val, "helper")) {
+				error = "Expected pacemaker, file or helper "
+					"for ticket-handler";
+				goto err;
+			}
+			safe_copy(booth_conf->ticket_handler,
+					val, BOOTH_NAME_LEN,
+					"ticket-handler");
+			continue;
+		}
+
+		if (strcmp(key, "ticket-handler-path") == 0) {
+			safe_copy(booth_conf->ticket_handler_path,
+					val, BOOTH_PATH_LEN,
+					"ticket-handler-path");
+			continue;
+		}
+
 		if (strcmp(key, "debug") == 0) {
 			if (type != CLIENT)
 				debug_level = max(debug_level, atoi(val));
@@ -579,8 +835,38 @@ no_value:
 			continue;
 		}
 
+		if (strcmp(key, "before-acquire-handler-timeout") == 0) {
+			current_tk->ext_verifier_timeout = strtol(val, &s, 0);
+			if (*s || s == val || current_tk->ext_verifier_timeout < 0) {
+				error = "Expected plain integer value >=0 for before-acquire-handler-timeout";
+				goto err;
+			}
+			continue;
+		}
+
+		if (strcmp(key, "before-acquire-handler-cache") == 0) {
+			current_tk->ext_verifier_cache = strtol(val, &s, 0);
+			if (*s || s == val || current_tk->ext_verifier_cache < 0) {
+				error = "Expected plain integer value >=0 for before-acquire-handler-cache";
+				goto err;
+			}
+			continue;
+		}
+
+		if (strcmp(key, "before-acquire-handler-cache-shared") == 0) {
+			if (strcasecmp(val, "yes") == 0)
+				current_tk->ext_verifier_cache_shared = 1;
+			else if (strcasecmp(val, "no") == 0)
+				current_tk->ext_verifier_cache_shared = 0;
+			else {
+				error = "Expected yes or no for before-acquire-handler-cache-shared";
+				goto err;
+			}
+			continue;
+		}
+
 		if (strcmp(key, "weights") == 0) {
-			if (parse_weights(val, current_tk->weight) < 0)
+			if (parse_weights(val, current_tk) < 0)
 				goto out;
 			continue;
 		}
@@ -593,6 +879,13 @@ no_value:
 		log_warn("An odd number of nodes is strongly recommended!");
 	}
 
+	if (setup_sitesets() < 0) {
+		error = "Out of memory";
+		goto err;
+	}
+
+	booth_conf->ticket_list_hash = ticket_list_hash();
+
 	/* Default: make config name match config filename. */
 	if (!booth_conf->name[0]) {
 		cp = strrchr(path, '/');
@@ -617,6 +910,8 @@ out:
 	log_error("%s in config file line %d",
 			error, lineno);
 
+	free(booth_conf->ticket_hash);
+	free(booth_conf->site_by_id);
 	free(booth_conf);
 	booth_conf = NULL;
 	return -1;
@@ -715,6 +1010,15 @@ int find_site_by_id(uint32_t site_id, struct booth_site **node)
 	if (!booth_conf)
 		return 0;
 
+	if (booth_conf->site_by_id) {
+		i = booth_conf->site_by_id[site_id % booth_conf->site_by_id_size];
+		n = booth_conf->site + i - 1;
+		if (!i || n->site_id != site_id)
+			return 0;
+		*node = n;
+		return 1;
+	}
+
 	for (i = 0; i < booth_conf->site_count; i++) {
 		n = booth_conf->site + i;
 		if (n->site_id == site_id) {
@@ -30,42 +30,27 @@
 /** @{ */
 /** Definitions for in-RAM data. */
 
-#define MAX_NODES	16
+#define SITE_ALLOC	8
 #define TICKET_ALLOC	16
 
 
 
-struct ticket_config {
-	/** \name Configuration items.
-	 * @{ */
-	/** Name of ticket. */
-	boothc_ticket name;
-
-	/** How many seconds a term lasts (if not refreshed). */
-	int term_duration;
-
-	/** Network related timeouts. */
-	int timeout;
-
-	/** Retries before giving up. */
-	int retries;
-
-	/** If >0, time to wait for a site to get fenced.
-	 * The ticket may be acquired after that timespan by
-	 * another site. */
-	int acquire_after; /* TODO: needed? */
-
-
-	/* Program to ask whether it makes sense to
-	 * acquire the ticket */
-	char *ext_verifier;
-
-	/** Node weights. */
-	int weight[MAX_NODES];
-	/** @} */
-
+/** The state that is sent instead of the current one while an
+ * election is running; see new_election() and send_msg(). */
+struct ticket_snapshot {
+	struct booth_site *leader;
+	struct booth_site *voted_for;
+	uint32_t current_term;
+	time_t term_expires;
+};
 
-	/** \name Runtime values.
+/** A ticket.
+ * The fields are grouped by how often they are used: first the ones
+ * needed by every timer run and packet, then the election state, and
+ * at the end the rarely touched configuration and bookkeeping of the
+ * CIB writer and the external handler. */
+struct ticket_config {
+	/** \name Runtime values, used all the time.
 	 * @{ */
 	/** Current state. */
 	server_state_e state;
@@ -75,57 +60,29 @@ struct ticket_config {
 
 	/** When something has to be done */
 	timetype next_cron;
+	/** Position in the timer heap (1-based), 0 if not queued.
+	 * See ticket_timer_update(). */
+	int timer_pos;
+	/** Idle and not granted anywhere we know of: not scheduled at
+	 * all until a client or a peer refers to it.
+	 * See ticket_wakeup(). */
+	int dormant;
 
 	/** Current leader. This is effectively the log[] in Raft. */
 	struct booth_site *leader;
+	struct booth_site *voted_for;
 
-	/** Leader that got lost. */
-	struct booth_site *lost_leader;
-
-	/** Is the ticket granted? */
-	int is_granted;
 	/** Timestamp of leadership expiration */
 	time_t term_expires;
 	/** End of election period */
 	time_t election_end;
-	struct booth_site *voted_for;
-
-
-	/** Who the various sites vote for.
-	 * NO_OWNER = no vote yet. */
-	struct booth_site *votes_for[MAX_NODES];
-	/* bitmap */
-	uint64_t votes_received;
 
 	/** Last voting round that was seen. */
 	uint32_t current_term;
 
-	/** Do ticket updates whenever we get enough heartbeats.
-	 * But do that only once.
-	 * This is reset to 0 whenever we broadcast heartbeat and set
-	 * to 1 once enough acks are received.
-	 * Increased to 2 when the ticket is commited to the CIB (see
-	 * delay_commit).
-	 */
-	uint32_t ticket_updated;
-	/** @} */
-
-
-	/** */
-	uint32_t last_applied;
-	uint32_t next_index[MAX_NODES];
-	uint32_t match_index[MAX_NODES];
-
-
-	/* Why did we start the elections?
+	/* Is this ticket in election?
 	*/
-	cmd_reason_t election_reason;
-
-	/* if it is potentially dangerous to grant the ticket
-	 * immediately, then this is set to some point in time,
-	 * usually (now + term_duration + acquire_after)
-	 */
-	time_t delay_commit;
+	int in_election;
 
 	/* the last request RPC we sent
 	 */
@@ -135,11 +92,15 @@ struct ticket_config {
 	 * replies were received
 	 */
 	uint32_t acks_expected;
-	/* bitmask of servers which sent acks
+	/* set of servers which sent acks
 	 */
-	uint64_t acks_received;
-	/* timestamp of the request, currently unused */
-	time_t req_sent_at;
+	siteset_word_t *acks_received;
+
+	/** Number of send retries left.
+	 * Used on the new owner.
+	 * Starts at 0, counts up. */
+	int retry_number;
+
 	/* we need to wait for MY_INDEX from other servers,
 	 * hold the ticket processing for a while until they reply
 	 */
@@ -152,44 +113,144 @@ struct ticket_config {
 	*/
 	int update_cib;
 
-	/* Is this ticket in election?
-	*/
-	int in_election;
+	/** Do ticket updates whenever we get enough heartbeats.
+	 * But do that only once.
+	 * This is reset to 0 whenever we broadcast heartbeat and set
+	 * to 1 once enough acks are received.
+	 * Increased to 2 when the ticket is commited to the CIB (see
+	 * delay_commit).
+	 */
+	uint32_t ticket_updated;
 
-	/* don't log warnings unnecessarily
+	/* if it is potentially dangerous to grant the ticket
+	 * immediately, then this is set to some point in time,
+	 * usually (now + term_duration + acquire_after)
 	 */
-	int expect_more_rejects;
-	/** \name Needed while proposals are being done.
+	time_t delay_commit;
+	/** @} */
+
+
+	/** \name Timing configuration, needed for every timer run.
 	 * @{ */
-	/* Need to keep the previous valid ticket in case we moved to
+	/** How many seconds a term lasts (if not refreshed). */
+	int term_duration;
+
+	/** Network related timeouts. */
+	int timeout;
+
+	/** Retries before giving up. */
+	int retries;
+	/** @} */
+
+
+	/** \name Needed while elections are being done.
+	 * @{ */
+	/* Why did we start the elections?
+	*/
+	cmd_reason_t election_reason;
+
+	/** Who the various sites vote for, indexed by booth_site.index.
+	 * NO_OWNER = no vote yet. */
+	struct booth_site **votes_for;
+	/* site set, see siteset.h */
+	siteset_word_t *votes_received;
+
+	/* Need to keep the previous valid state in case we moved to
 	 * start new elections and another server asks for the ticket
 	 * status. It would be wrong to send our candidate ticket.
 	*/
-	struct ticket_config *last_valid_tk;
+	struct ticket_snapshot last_valid;
 
-	/** Whom to vote for the next time.
-	 * Needed to push a ticket to someone else. */
+	/** Leader that got lost. */
+	struct booth_site *lost_leader;
 
+	/** Election rounds we started since we last had a leader. */
+	int election_rounds;
+	/** We left the next round to the tied candidate that goes
+	 * first, see elections_end(). */
+	int tie_deferred;
 
+	/** The site we promised our vote for successor_term to, and
+	 * until when; see answer_COND_VOTE(). */
+	struct booth_site *successor;
+	uint32_t successor_term;
+	time_t successor_until;
+	/** We are the successor, and a majority agreed. */
+	int successor_elected;
 
-#if 0
-	/** Bitmap of sites that acknowledge that state. */
-	uint64_t proposal_acknowledges;
+	/** Is the ticket granted? */
+	int is_granted;
 
-	/** When an incompletely acknowledged proposal gets done.
-	 * If all peers agree, that happens sooner.
-	 * See switch_state_to(). */
-	struct timeval proposal_switch;
+	/* don't log warnings unnecessarily
+	 */
+	int expect_more_rejects;
 
-	/** Timestamp of proposal expiration. */
-	time_t proposal_expires;
+	/** When the request went out; its acks give RTT samples, see
+	 * update_acks(). */
+	timetype req_sent_at;
+	/** @} */
 
-#endif
 
-	/** Number of send retries left.
-	 * Used on the new owner.
-	 * Starts at 0, counts up. */
-	int retry_number;
+	/** \name Other configuration items.
+	 * @{ */
+	/** Name of ticket. */
+	boothc_ticket name;
+
+	/** If >0, time to wait for a site to get fenced.
+	 * The ticket may be acquired after that timespan by
+	 * another site. */
+	int acquire_after; /* TODO: needed? */
+
+
+	/* Program to ask whether it makes sense to
+	 * acquire the ticket */
+	char *ext_verifier;
+	/** Seconds the program may run; 0 means half the expiry time. */
+	int ext_verifier_timeout;
+	/** Seconds a success is remembered for renewals; 0 means never. */
+	int ext_verifier_cache;
+	/** Share the remembered result with tickets using the same
+	 * program. */
+	int ext_verifier_cache_shared;
+
+	/** Node weights, in the order of the sites; missing ones are 0. */
+	int *weight;
+	int weight_count;
+	/** @} */
+
+
+	/** \name State to be written to the CIB, see store.c.
+	 * @{ */
+	struct booth_site *cib_leader;
+	time_t cib_expires;
+	uint32_t cib_term;
+	/** Not written yet */
+	int cib_dirty;
+	/** Waiting for a free writer */
+	int cib_queued;
+	/** Being written right now */
+	int cib_busy;
+	/** Ack owed to this site for cib_ack_request, sent once the
+	 * state above is written; see ack_when_written() */
+	struct booth_site *cib_ack_to;
+	uint32_t cib_ack_request;
+	/** @} */
+
+	/** \name Running before-acquire-handler, see handler.c.
+	 * @{ */
+	/** What the result is for (VERIFY_*), 0 if nothing pending */
+	int verify_for;
+	/** Why the ticket is to be acquired */
+	cmd_reason_t verify_reason;
+	/** Process (group), 0 while waiting for a free slot */
+	pid_t verify_pid;
+	/** When it gets a signal */
+	time_t verify_deadline;
+	/** Got a SIGTERM already */
+	int verify_killed;
+	/** Last success is valid till then, see handler_cached_ok() */
+	time_t verify_cached_until;
+	int verify_cached_gen;
 	/** @} */
 };
 
@@ -198,11 +259,14 @@ struct booth_config {
 
     transport_layer_t proto;
     uint16_t port;
+    /** SO_RCVBUF and SO_SNDBUF of the UDP socket */
+    int udp_buffer_size;
 
-    /** Stores the OR of sites bitmasks. */
-    uint64_t sites_bits;
-    /** Stores the OR of all members' bitmasks. */
-    uint64_t all_bits;
+    /** All sites (without arbitrators), and all members. */
+    siteset_word_t *sites_set;
+    siteset_word_t *all_set;
+    /** Size of a site set, see siteset.h. */
+    int siteset_words;
 
     char site_user[BOOTH_NAME_LEN];
     char site_group[BOOTH_NAME_LEN];
@@ -212,11 +276,25 @@ struct booth_config {
     gid_t gid;
 
     int site_count;
-    struct booth_site site[MAX_NODES];
+    int site_allocated;
+    struct booth_site *site;
+    /** Index of the sites by site_id, see find_site_by_id(). */
+    int *site_by_id;
+    int site_by_id_size;
 
     int ticket_count;
     int ticket_allocated;
     struct ticket_config *ticket;
+    /** Hash index of the ticket names, see ticket_hash_find(). */
+    int *ticket_hash;
+    int ticket_hash_size;
+    /** Identifies the ticket names and their order, see
+     * struct boothc_multi_rec. */
+    uint32_t ticket_list_hash;
+
+    /** See store.c */
+    char ticket_handler[BOOTH_NAME_LEN];
+    char ticket_handler_path[BOOTH_PATH_LEN];
 };
 
 
@@ -227,6 +305,7 @@ int read_config(const char *path, int type);
 
 int check_config(int type);
 
+int ticket_hash_find(const char *name);
 int find_site_by_name(unsigned char *site, struct booth_site **node, int any_type);
 int find_site_by_id(uint32_t site_id, struct booth_site **node);
 
@@ -19,11 +19,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <arpa/inet.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include "ticket.h"
 #include "config.h"
 #include "inline-fn.h"
@@ -33,38 +39,428 @@
 #include "handler.h"
 
 
+/** \file
+ * Asynchronous external handlers (see 'before-acquire-handler').
+ *
+ * The handlers are started with posix_spawn(), each in its own
+ * process group, and with the BOOTH_* variables in their own
+ * environment only. A SIGCHLD handler just writes into a pipe that is
+ * watched by the main loop; the handlers are then reaped by their pid,
+ * so that the other child processes of boothd are left alone.
+ *
+ * At most HANDLER_JOBS_MAX handlers run at the same time; the others
+ * wait in a queue. A handler that doesn't finish in time gets a
+ * SIGTERM, and HANDLER_KILL_GRACE seconds later a SIGKILL; that
+ * counts as failure.
+ *
+ * With 'before-acquire-handler-cache' a success is remembered for
+ * that many seconds, and renewals during that time don't run the
+ * handler (see handler_cached_ok()). SIGUSR2 forgets all of them.
+ */
+
+
+extern char **environ;
+
+static int sigchld_pipe[2] = { -1, -1 };
+
+/** The tickets whose handler is running; so that the main loop only
+ * looks at these, not at all tickets. */
+static struct ticket_config *jobs[HANDLER_JOBS_MAX];
+static int jobs_running;
+
+/** Bumped by SIGUSR2; cached results of older generations are void. */
+static volatile sig_atomic_t cache_generation;
+
+/** Tickets waiting for a free slot, a ring buffer.
+ * A ticket is in here at most once (see verify_for). */
+static struct ticket_config **queue;
+static int queue_head, queue_len;
+
+
+static int queue_ticket(struct ticket_config *tk)
+{
+	int size = booth_conf->ticket_count;
+
+	if (!queue) {
+		queue = calloc(size, sizeof(*queue));
+		if (!queue) {
+			log_error("out of memory for the handler queue");
+			return -ENOMEM;
+		}
+	}
+
+	queue[(queue_head + queue_len) % size] = tk;
+	queue_len++;
+	return 0;
+}
+
+
+static struct ticket_config *dequeue_ticket(void)
+{
+	struct ticket_config *tk;
+
+	tk = queue[queue_head];
+	queue_head = (queue_head + 1) % booth_conf->ticket_count;
+	queue_len--;
+	return tk;
+}
+
+
+static int handler_timeout(struct ticket_config *tk)
+{
+	if (tk->ext_verifier_timeout)
+		return tk->ext_verifier_timeout;
+
+	/* Renewal happens after half the term, so the result has to be
+	 * there before the other half is over. */
+	return tk->term_duration / 2 ?: 1;
+}
+
+
+/** The daemon's environment, plus the BOOTH_* variables.
+ * The strings are in vars; only the returned array needs to be freed. */
+static char **handler_env(struct ticket_config *tk,
+		char vars[][BOOTH_PATH_LEN + 32])
+{
+	char **envp;
+	int i, n;
+
+	for (n = 0; environ[n]; n++)
+		;
+
+	envp = malloc((n + HANDLER_ENV_VARS + 1) * sizeof(*envp));
+	if (!envp)
+		return NULL;
+
+	snprintf(vars[0], sizeof(vars[0]), "BOOTH_TICKET=%s", tk->name);
+	snprintf(vars[1], sizeof(vars[1]), "BOOTH_LOCAL=%s",
+			local->addr_string);
+	snprintf(vars[2], sizeof(vars[2]), "BOOTH_CONF_NAME=%s",
+			booth_conf->name);
+	snprintf(vars[3], sizeof(vars[3]), "BOOTH_CONF_PATH=%s",
+			cl.configfile);
+	snprintf(vars[4], sizeof(vars[4]), "BOOTH_TICKET_EXPIRES=%" PRId64,
+			(int64_t)wall_ts(tk->term_expires));
+
+	n = 0;
+	for (i = 0; environ[i]; i++)
+		if (strncmp(environ[i], "BOOTH_", 6) != 0)
+			envp[n++] = environ[i];
+	for (i = 0; i < HANDLER_ENV_VARS; i++)
+		envp[n++] = vars[i];
+	envp[n] = NULL;
+
+	return envp;
+}
+
 
-/** Runs an external handler.
- * See eg. 'before-acquire-handler'.
- * TODO: timeout, async operation?. */
-int run_handler(struct ticket_config *tk,
-		const char *cmd, int synchronous)
+static int start_job(struct ticket_config *tk)
 {
+	char vars[HANDLER_ENV_VARS][BOOTH_PATH_LEN + 32];
+	char *argv[] = { "/bin/sh", "-c", tk->ext_verifier, NULL };
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	char **envp;
+	pid_t pid;
 	int rv;
-	char expires[16];
 
-	if (!cmd)
-		return 0;
+	envp = handler_env(tk, vars);
+	if (!envp) {
+		log_error("out of memory for the handler environment");
+		return -ENOMEM;
+	}
 
-	assert(synchronous);
-	sprintf(expires, "%" PRId64, (int64_t)wall_ts(tk->term_expires));
+	posix_spawnattr_init(&attr);
+	/* Don't inherit our signal setup. */
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	/* An own process group, so that a timeout kills everything
+	 * the handler started. */
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+			POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
 
-	rv = setenv("BOOTH_TICKET", tk->name, 1) ||
-		setenv("BOOTH_LOCAL", local->addr_string, 1) ||
-		setenv("BOOTH_CONF_NAME", booth_conf->name, 1) ||
-		setenv("BOOTH_CONF_PATH", cl.configfile, 1) ||
-		setenv("BOOTH_TICKET_EXPIRES", expires, 1);
+	rv = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, envp);
+	posix_spawnattr_destroy(&attr);
+	free(envp);
 
 	if (rv) {
-		log_error("Cannot set environment: %s", strerror(errno));
+		tk_log_error("cannot start handler \"%s\": %s",
+				tk->ext_verifier, strerror(rv));
+		return -rv;
+	}
+
+	tk->verify_pid = pid;
+	tk->verify_killed = 0;
+	tk->verify_deadline = get_secs(NULL) + handler_timeout(tk);
+	jobs[jobs_running++] = tk;
+	tk_log_debug("handler \"%s\" started, pid %d",
+			tk->ext_verifier, (int)pid);
+	return 0;
+}
+
+
+/** Hand the result to the ticket code. */
+static void handler_done(struct ticket_config *tk, int rv)
+{
+	int for_what;
+
+	for_what = tk->verify_for;
+	tk->verify_for = 0;
+	tk->verify_pid = 0;
+
+	ticket_verified(tk, for_what, rv);
+}
+
+
+static void start_queued(void)
+{
+	struct ticket_config *tk;
+
+	while (queue_len && jobs_running < HANDLER_JOBS_MAX) {
+		tk = dequeue_ticket();
+		if (start_job(tk) < 0)
+			handler_done(tk, -1);
+	}
+}
+
+
+static int cache_fresh(struct ticket_config *tk, time_t now)
+{
+	return tk->verify_cached_until > now &&
+		tk->verify_cached_gen == cache_generation;
+}
+
+
+static int same_cache(struct ticket_config *tk, struct ticket_config *other)
+{
+	return tk->ext_verifier_cache_shared &&
+		other->ext_verifier_cache_shared &&
+		other->ext_verifier &&
+		!strcmp(tk->ext_verifier, other->ext_verifier);
+}
+
+
+/** Remember (or forget) a result; only successes are kept. */
+static void cache_result(struct ticket_config *tk, int status)
+{
+	struct ticket_config *other;
+	int i;
+
+	if (!tk->ext_verifier_cache)
+		return;
+
+	if (!status) {
+		tk->verify_cached_until = get_secs(NULL) + tk->ext_verifier_cache;
+		tk->verify_cached_gen = cache_generation;
+		return;
+	}
+
+	tk->verify_cached_until = 0;
+	/* A failure is just as true for the others. */
+	foreach_ticket(i, other) {
+		if (same_cache(tk, other))
+			other->verify_cached_until = 0;
+	}
+}
+
+
+/** Whether the handler succeeded recently enough to skip running it.
+ * With 'before-acquire-handler-cache-shared', a success of the same
+ * command for another ticket counts, too. */
+int handler_cached_ok(struct ticket_config *tk)
+{
+	struct ticket_config *other;
+	time_t now;
+	int i;
+
+	if (!tk->ext_verifier_cache)
+		return 0;
+
+	now = get_secs(NULL);
+	if (cache_fresh(tk, now))
+		goto ok;
+
+	foreach_ticket(i, other) {
+		if (other != tk && same_cache(tk, other) &&
+				cache_fresh(other, now))
+			goto ok;
+	}
+	return 0;
+
+ok:
+	tk_log_debug("using the cached before-acquire-handler result");
+	return 1;
+}
+
+
+/** @i is the index in jobs[]; the last one takes its place. */
+static void job_finished(int i, int status)
+{
+	struct ticket_config *tk = jobs[i];
+
+	jobs[i] = jobs[--jobs_running];
+
+	if (tk->verify_killed) {
+		tk_log_warn("handler \"%s\" timed out", tk->ext_verifier);
+		status = status ?: -ETIMEDOUT;
+	} else if (status) {
+		tk_log_warn("handler \"%s\" exited with error %s",
+				tk->ext_verifier, interpret_rv(status));
 	} else {
-		rv = system(cmd);
-		if (rv)
-			tk_log_warn("handler \"%s\" exited with error %s",
-					cmd, interpret_rv(rv));
-		else
-			tk_log_debug("handler \"%s\" exited with success", cmd);
+		tk_log_debug("handler \"%s\" exited with success",
+				tk->ext_verifier);
+	}
+
+	cache_result(tk, status);
+	start_queued();
+	handler_done(tk, status);
+}
+
+
+/** Callback for the SIGCHLD pipe. */
+static void handler_reap(int ci)
+{
+	struct ticket_config *tk;
+	char buf[64];
+	int i, status;
+
+	while (read(clients[ci].fd, buf, sizeof(buf)) > 0)
+		;
+
+	/* Backwards: a finished job is replaced by the last one, and
+	 * the ones started meanwhile are added at the end. */
+	for (i = jobs_running - 1; i >= 0; i--) {
+		tk = jobs[i];
+		if (waitpid(tk->verify_pid, &status, WNOHANG) == tk->verify_pid)
+			job_finished(i, status);
+	}
+}
+
+
+static void cache_flush_handler(int sig)
+{
+	cache_generation++;
+}
+
+
+static void sigchld_handler(int sig)
+{
+	int saved_errno = errno;
+	ssize_t rv;
+
+	/* If the pipe is full, a wakeup is pending anyway. */
+	rv = write(sigchld_pipe[1], "", 1);
+	(void)rv;
+	errno = saved_errno;
+}
+
+
+int handler_init(void)
+{
+	struct sigaction sa;
+
+	if (pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		log_error("cannot create pipe: %s", strerror(errno));
+		return -errno;
+	}
+
+	if (client_add(sigchld_pipe[0], NULL, handler_reap, NULL) < 0)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+		log_error("cannot set SIGCHLD handler: %s", strerror(errno));
+		return -errno;
+	}
+
+	signal(SIGUSR2, cache_flush_handler);
+
+	return 0;
+}
+
+
+/** Runs the 'before-acquire-handler' of a ticket.
+ * Doesn't wait for it; the result is given to ticket_verified(),
+ * along with for_what (VERIFY_*).
+ * Returns 0 if started (or queued), <0 on errors. */
+int run_handler(struct ticket_config *tk, int for_what)
+{
+	int rv;
+
+	if (tk->verify_for)
+		return -EBUSY;
+
+	tk->verify_for = for_what;
+	if (jobs_running < HANDLER_JOBS_MAX)
+		rv = start_job(tk);
+	else {
+		tk_log_debug("%d handlers running, queueing", jobs_running);
+		rv = queue_ticket(tk);
 	}
 
+	if (rv < 0)
+		tk->verify_for = 0;
 	return rv;
 }
+
+
+/** Milliseconds until the first handler times out, or -1. */
+int handler_next_timeout(void)
+{
+	struct ticket_config *tk;
+	time_t now, first;
+	int i;
+
+	if (!jobs_running)
+		return -1;
+
+	first = jobs[0]->verify_deadline;
+	for (i = 1; i < jobs_running; i++) {
+		tk = jobs[i];
+		if (tk->verify_deadline < first)
+			first = tk->verify_deadline;
+	}
+
+	now = get_secs(NULL);
+	if (first <= now)
+		return 0;
+	return (first - now) * 1000;
+}
+
+
+void process_handler_timeouts(void)
+{
+	struct ticket_config *tk;
+	time_t now;
+	int i;
+
+	if (!jobs_running)
+		return;
+
+	now = get_secs(NULL);
+	for (i = 0; i < jobs_running; i++) {
+		tk = jobs[i];
+		if (tk->verify_deadline > now)
+			continue;
+
+		if (!tk->verify_killed)
+			tk_log_warn("handler \"%s\" takes longer than %ds, "
+					"terminating it",
+					tk->ext_verifier, handler_timeout(tk));
+		kill(-tk->verify_pid,
+				tk->verify_killed ? SIGKILL : SIGTERM);
+		tk->verify_killed = 1;
+		tk->verify_deadline = now + HANDLER_KILL_GRACE;
+	}
+}
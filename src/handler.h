@@ -19,8 +19,25 @@
 #ifndef _HANDLER_H
 #define _HANDLER_H
 
-int run_handler(struct ticket_config *tk,
-		const char *cmd, int synchronous);
+/** How many handlers may run at the same time. */
+#define HANDLER_JOBS_MAX	8
+/** Seconds between SIGTERM and SIGKILL for a handler that timed out. */
+#define HANDLER_KILL_GRACE	2
+/** Number of BOOTH_* variables passed to a handler. */
+#define HANDLER_ENV_VARS	5
+
+/** What the result of the handler is needed for. */
+enum {
+	VERIFY_NONE = 0,
+	VERIFY_ACQUIRE,	/* grant or reacquire, see acquire_ticket() */
+	VERIFY_RENEW,	/* ticket renewal by the leader */
+};
+
+int handler_init(void);
+int run_handler(struct ticket_config *tk, int for_what);
+int handler_cached_ok(struct ticket_config *tk);
+int handler_next_timeout(void);
+void process_handler_timeouts(void);
 
 
 #endif
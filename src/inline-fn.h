@@ -26,6 +26,7 @@
 #include "timer.h"
 #include "config.h"
 #include "transport.h"
+#include "siteset.h"
 
 
 
@@ -66,6 +67,48 @@ inline static int is_owned(const struct ticket_config *tk)
 	return (tk->leader && tk->leader != no_leader);
 }
 
+/** Configured weight of the site for this ticket. */
+inline static int site_weight(const struct ticket_config *tk,
+		const struct booth_site *site)
+{
+	return site->index < tk->weight_count ? tk->weight[site->index] : 0;
+}
+
+/** Does @a go before @b? Higher weight first, then the order in
+ * the configuration file. */
+inline static int site_outranks(const struct ticket_config *tk,
+		const struct booth_site *a, const struct booth_site *b)
+{
+	if (site_weight(tk, a) != site_weight(tk, b))
+		return site_weight(tk, a) > site_weight(tk, b);
+	return a->index < b->index;
+}
+
+/** Is a successor waiting for the current term to run out?
+ * See answer_COND_VOTE(). */
+inline static int succession_pending(const struct ticket_config *tk)
+{
+	return tk->successor &&
+		tk->successor_term > tk->current_term &&
+		(tk->successor != local || tk->successor_elected) &&
+		get_secs(NULL) < tk->successor_until;
+}
+
+/** Would @site, leading in @term, break a promise we made? */
+inline static int promised_elsewhere(const struct ticket_config *tk,
+		const struct booth_site *site, uint32_t term)
+{
+	return succession_pending(tk) &&
+		(term < tk->successor_term ||
+		 (term == tk->successor_term && site != tk->successor));
+}
+
+/** Is some other site the leader? */
+inline static int is_owned_elsewhere(const struct ticket_config *tk)
+{
+	return is_owned(tk) && tk->leader != local;
+}
+
 
 static inline void init_header_bare(struct boothc_header *h) {
 	h->magic   = htonl(BOOTHC_MAGIC);
@@ -95,8 +138,21 @@ static inline void init_ticket_site_header(struct boothc_ticket_msg *msg, int cm
 }
 
 #define my_last_term(tk) \
-	(((tk)->state == ST_CANDIDATE && (tk)->last_valid_tk->current_term) ? \
-	(tk)->last_valid_tk->current_term : (tk)->current_term)
+	(((tk)->state == ST_CANDIDATE && (tk)->last_valid.current_term) ? \
+	(tk)->last_valid.current_term : (tk)->current_term)
+
+static inline void init_ticket_msg_state(struct boothc_ticket_msg *msg,
+		struct booth_site *leader, struct booth_site *voted_for,
+		uint32_t term, time_t expires)
+{
+	int left;
+
+	left = expires - get_secs(NULL);
+	msg->ticket.leader         = htonl(get_node_id(
+		(leader && leader != no_leader) ? leader : voted_for));
+	msg->ticket.term           = htonl(term);
+	msg->ticket.term_valid_for = htonl((left < 0) ? 0 : left);
+}
 
 static inline void init_ticket_msg(struct boothc_ticket_msg *msg,
 		int cmd, int request, int rv, int reason,
@@ -110,14 +166,24 @@ static inline void init_ticket_msg(struct boothc_ticket_msg *msg,
 		memset(&msg->ticket, 0, sizeof(msg->ticket));
 	} else {
 		memcpy(msg->ticket.id, tk->name, sizeof(msg->ticket.id));
-
-		msg->ticket.leader         = htonl(get_node_id(
-			(tk->leader && tk->leader != no_leader) ? tk->leader : tk->voted_for));
-		msg->ticket.term           = htonl(tk->current_term);
-		msg->ticket.term_valid_for = htonl(term_time_left(tk));
+		init_ticket_msg_state(msg, tk->leader, tk->voted_for,
+				tk->current_term, tk->term_expires);
 	}
 }
 
+/** Like init_ticket_msg(), but with the state from before the
+ * current election. */
+static inline void init_ticket_msg_last_valid(struct boothc_ticket_msg *msg,
+		int cmd, int request, int rv, int reason,
+		struct ticket_config *tk)
+{
+	const struct ticket_snapshot *lv = &tk->last_valid;
+
+	init_ticket_msg(msg, cmd, request, rv, reason, tk);
+	init_ticket_msg_state(msg, lv->leader, lv->voted_for,
+			lv->current_term, lv->term_expires);
+}
+
 
 static inline struct booth_transport const *transport(void)
 {
@@ -252,8 +318,8 @@ static inline void expect_replies(struct ticket_config *tk,
 {
 	tk->retry_number = 0;
 	tk->acks_expected = reply_type;
-	tk->acks_received = local->bitmask;
-	tk->req_sent_at  = get_secs(NULL);
+	siteset_only(tk->acks_received, local);
+	get_time(&tk->req_sent_at);
 	tk->ticket_updated = 0;
 }
 
@@ -269,27 +335,24 @@ static inline struct booth_site *my_vote(struct ticket_config *tk)
 }
 
 
-static inline int count_bits(uint64_t val) {
-	return __builtin_popcount(val);
-}
-
-static inline int majority_of_bits(struct ticket_config *tk, uint64_t val)
+static inline int majority_of_sites(struct ticket_config *tk,
+		const siteset_word_t *set)
 {
 	/* Use ">" to get majority decision, even for an even number
 	 * of participants. */
-	return count_bits(val) * 2 >
+	return siteset_count(set) * 2 >
 		booth_conf->site_count;
 }
 
 
 static inline int all_replied(struct ticket_config *tk)
 {
-	return !(tk->acks_received ^ booth_conf->all_bits);
+	return siteset_includes(tk->acks_received, booth_conf->all_set);
 }
 
 static inline int all_sites_replied(struct ticket_config *tk)
 {
-	return !((tk->acks_received & booth_conf->sites_bits) ^ booth_conf->sites_bits);
+	return siteset_includes(tk->acks_received, booth_conf->sites_set);
 }
 
 
@@ -31,7 +31,7 @@
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
 #include <pacemaker/crm/services.h>
 #include <clplumbing/setproctitle.h>
 #include <sys/prctl.h>
@@ -54,11 +54,17 @@
 #include "inline-fn.h"
 #include "pacemaker.h"
 #include "ticket.h"
+#include "store.h"
+#include "handler.h"
 
 #define RELEASE_VERSION		"0.2.0"
 #define RELEASE_STR 	RELEASE_VERSION " (build " BOOTH_BUILD_VERSION ")"
 
 #define CLIENT_NALLOC		32
+#define EPOLL_EVENTS_MAX	64
+
+/** Seconds a client connection may be idle before it's dropped. */
+#define CLIENT_CONN_TIMEOUT	10
 
 int daemonize = 0;
 int enable_stderr = 0;
@@ -66,14 +72,26 @@ time_t start_time;
 
 
 /** Structure for "clients".
- * Filehandles with incoming data get registered here (and in pollfds),
- * along with their callbacks.
+ * Filehandles with incoming data get registered here (and in the epoll
+ * set, with the index as event data), along with their callbacks.
  * Because these can be reallocated with every new fd, addressing
  * happens _only_ by their numeric index. */
 struct client *clients = NULL;
-struct pollfd *pollfds = NULL;
-static int client_maxi;
 static int client_size = 0;
+static int epoll_fd = -1;
+
+/** Unused slots, linked via ->next_free.
+ * Slots given up while events are being dispatched are put on
+ * client_released first; else a still pending event for the old fd
+ * could be delivered to a new client that got the same slot. */
+static int client_free = -1;
+static int client_released = -1;
+
+/** Client connections, ordered by deadline.
+ * All connections get the same timeout, so refreshing one just means
+ * moving it to the end. */
+static int conn_first = -1;
+static int conn_last = -1;
 
 
 static const struct booth_site _no_leader = {
@@ -88,8 +106,6 @@ typedef enum
 	BOOTHD_STARTING
 } BOOTH_DAEMON_STATE;
 
-int poll_timeout = POLL_TIMEOUT;
-
 
 
 struct booth_config *booth_conf;
@@ -140,38 +156,101 @@ static void client_alloc(void)
 	int i;
 
 	if (!clients) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0) {
+			log_error("can't create epoll instance: %s", strerror(errno));
+			exit(1);
+		}
 		clients = malloc(CLIENT_NALLOC * sizeof(struct client));
-		pollfds = malloc(CLIENT_NALLOC * sizeof(struct pollfd));
 	} else {
 		clients = realloc(clients, (client_size + CLIENT_NALLOC) *
 					sizeof(struct client));
-		pollfds = realloc(pollfds, (client_size + CLIENT_NALLOC) *
-					sizeof(struct pollfd));
 	}
-	if (!clients || !pollfds) {
+	if (!clients) {
 		log_error("can't alloc for client array");
 		exit(1);
 	}
 
-	for (i = client_size; i < client_size + CLIENT_NALLOC; i++) {
+	/* Push in reverse order, so that the lowest index is used first. */
+	for (i = client_size + CLIENT_NALLOC - 1; i >= client_size; i--) {
 		clients[i].workfn = NULL;
 		clients[i].deadfn = NULL;
 		clients[i].fd = -1;
-		pollfds[i].fd = -1;
-		pollfds[i].revents = 0;
+		clients[i].next_free = client_free;
+		client_free = i;
 	}
 	client_size += CLIENT_NALLOC;
 }
 
-static void client_dead(int ci)
+static void conn_unlink(int ci)
+{
+	struct client *c = clients + ci;
+
+	if (c->conn_prev == -1 && conn_first != ci)
+		return;
+
+	if (c->conn_prev != -1)
+		clients[c->conn_prev].conn_next = c->conn_next;
+	else
+		conn_first = c->conn_next;
+	if (c->conn_next != -1)
+		clients[c->conn_next].conn_prev = c->conn_prev;
+	else
+		conn_last = c->conn_prev;
+
+	c->conn_prev = c->conn_next = -1;
+}
+
+/** (Re-)start the idle timer of a client connection. */
+static void conn_touch(int ci)
 {
-	if (clients[ci].fd != -1)
-		close(clients[ci].fd);
+	struct client *c = clients + ci;
 
-	clients[ci].fd = -1;
-	clients[ci].workfn = NULL;
+	conn_unlink(ci);
 
-	pollfds[ci].fd = -1;
+	c->deadline = get_secs(NULL) + CLIENT_CONN_TIMEOUT;
+	c->conn_prev = conn_last;
+	if (conn_last != -1)
+		clients[conn_last].conn_next = ci;
+	else
+		conn_first = ci;
+	conn_last = ci;
+}
+
+void client_dead(int ci)
+{
+	struct client *c = clients + ci;
+
+	if (c->fd != -1) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+		close(c->fd);
+	}
+
+	c->fd = -1;
+	c->workfn = NULL;
+
+	conn_unlink(ci);
+	free(c->msg);
+	c->msg = NULL;
+	free(c->out);
+	c->out = NULL;
+	c->wait_tk = NULL;
+
+	c->next_free = client_released;
+	client_released = ci;
+}
+
+/* Make the slots given up during the last dispatch round available. */
+static void client_reuse_released(void)
+{
+	int ci;
+
+	while (client_released != -1) {
+		ci = client_released;
+		client_released = clients[ci].next_free;
+		clients[ci].next_free = client_free;
+		client_free = ci;
+	}
 }
 
 int client_add(int fd, const struct booth_transport *tpt,
@@ -180,140 +259,362 @@ int client_add(int fd, const struct booth_transport *tpt,
 {
 	int i;
 	struct client *c;
+	struct epoll_event ev;
 
 
-	if (client_size + 2 >= client_maxi ) {
+	if (client_free == -1)
 		client_alloc();
+
+	i = client_free;
+	c = clients + i;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = i;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		log_error("can't add fd %d to the epoll set: %s",
+				fd, strerror(errno));
+		return -1;
 	}
 
-	for (i = 0; i < client_size; i++) {
-		c = clients + i;
-		if (c->fd != -1)
-			continue;
+	client_free = c->next_free;
 
-		c->workfn = workfn;
-		if (deadfn)
-			c->deadfn = deadfn;
-		else
-			c->deadfn = client_dead;
+	c->workfn = workfn;
+	if (deadfn)
+		c->deadfn = deadfn;
+	else
+		c->deadfn = client_dead;
 
-		c->transport = tpt;
-		c->fd = fd;
+	c->transport = tpt;
+	c->fd = fd;
 
-		pollfds[i].fd = fd;
-		pollfds[i].events = POLLIN;
-		if (i > client_maxi)
-			client_maxi = i;
+	c->state = CONN_HEADER;
+	c->msg = NULL;
+	c->offset = 0;
+	c->out = NULL;
+	c->out_len = c->out_pos = 0;
+	c->conn_prev = c->conn_next = -1;
+	c->wait_tk = NULL;
+
+	return i;
+}
+
+
+/** Wait for the fd to become writable (instead of readable). */
+static void client_want_write(int ci, int on)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = on ? EPOLLOUT : EPOLLIN;
+	ev.data.u32 = ci;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, clients[ci].fd, &ev) < 0)
+		log_error("can't modify fd %d in the epoll set: %s",
+				clients[ci].fd, strerror(errno));
+}
+
+
+/** Prepare an accepted client connection. */
+int client_conn_start(int ci)
+{
+	struct client *c = clients + ci;
 
-		return i;
+	c->msg = malloc(sizeof(struct boothc_ticket_msg));
+	if (!c->msg) {
+		log_error("out of memory for client connection");
+		return -ENOMEM;
 	}
 
-	assert(!"no client");
+	conn_touch(ci);
+	return 0;
 }
 
 
-/* Only used for client requests, TCP ???*/
-void process_connection(int ci)
+/** Queue data to be sent on a client connection.
+ * It gets written out by process_connection(). */
+int client_send(int ci, void *buf, int len)
 {
-	struct boothc_ticket_msg msg;
-	int rv, len, expr, fd;
-	void (*deadfn) (int ci);
+	struct client *c = clients + ci;
+	char *out;
+
+	out = realloc(c->out, c->out_len + len);
+	if (!out) {
+		log_error("out of memory for client reply");
+		return -ENOMEM;
+	}
 
+	memcpy(out + c->out_len, buf, len);
+	c->out = out;
+	c->out_len += len;
+	return 0;
+}
 
-	fd = clients[ci].fd;
-	rv = do_read(fd, &msg.header, sizeof(msg.header));
 
-	if (rv < 0) {
-		if (errno == ECONNRESET)
-			log_debug("client %d connection reset for fd %d",
-					ci, clients[ci].fd);
+/** Don't answer the request yet.
+ * Used when the answer depends on something that runs in the
+ * background, eg. the before-acquire-handler; the connection doesn't
+ * time out meanwhile. See client_resume(). */
+void client_wait(int ci, struct ticket_config *tk)
+{
+	clients[ci].wait_tk = tk;
+}
+
+
+/** Returns a connection waiting for tk, or -1. */
+int client_waiting_for(struct ticket_config *tk)
+{
+	int ci;
+
+	for (ci = 0; ci < client_size; ci++)
+		if (clients[ci].fd >= 0 && clients[ci].wait_tk == tk)
+			return ci;
+	return -1;
+}
+
+
+/** Milliseconds until the first client connection times out, or -1. */
+static int client_conn_timeout(void)
+{
+	time_t now;
 
-		goto kill;
+	if (conn_first == -1)
+		return -1;
+
+	now = get_secs(NULL);
+	if (clients[conn_first].deadline <= now)
+		return 0;
+	return (clients[conn_first].deadline - now) * 1000;
+}
+
+
+static void process_conn_timeouts(void)
+{
+	time_t now;
+	int ci;
+
+	now = get_secs(NULL);
+	while (conn_first != -1 &&
+			clients[conn_first].deadline <= now) {
+		ci = conn_first;
+		log_debug("client connection %d fd %d timed out in state %d",
+				ci, clients[ci].fd, clients[ci].state);
+		/* unlinks it, too */
+		clients[ci].deadfn(ci);
 	}
+}
+
+
+/** Read (the rest of) a request.
+ * Returns 1 if the message is complete, 0 if more data is needed, and
+ * -1 if the connection should be closed. */
+static int read_client(int ci)
+{
+	struct client *c = clients + ci;
+	char *buf = (char *)c->msg;
+	int rv, len, want;
+
+	while (1) {
+		want = c->state == CONN_HEADER ?
+			sizeof(c->msg->header) : sizeof(*c->msg);
+
+		rv = read(c->fd, buf + c->offset, want - c->offset);
+		if (rv == 0) {
+			if (c->offset)
+				log_error("connection %d closed in the middle "
+						"of a message", ci);
+			return -1;
+		}
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (rv == -1) {
+			if (errno == ECONNRESET)
+				log_debug("client %d connection reset for fd %d",
+						ci, c->fd);
+			else
+				log_error("connection %d read error: %s",
+						ci, strerror(errno));
+			return -1;
+		}
 
-	if (check_boothc_header(&msg.header, -1) < 0)
-		goto kill;
+		c->offset += rv;
+		conn_touch(ci);
+		if (c->offset < want)
+			continue;
+
+		if (c->state == CONN_BODY)
+			return 1;
 
-	/* Basic sanity checks already done. */
-	len = ntohl(msg.header.length);
-	if (len) {
-		if (len != sizeof(msg)) {
-bad_len:
+		if (check_boothc_header(&c->msg->header, -1) < 0)
+			return -1;
+
+		/* Basic sanity checks already done. */
+		len = ntohl(c->msg->header.length);
+		if (len != sizeof(*c->msg)) {
 			log_error("got wrong length %u", len);
-			return;
+			return -1;
 		}
-		expr = len - sizeof(msg.header);
-		rv = do_read(clients[ci].fd, msg.header.data, expr);
-		if (rv < 0) {
-			log_error("connection %d read data error %d, wanted %d",
-					ci, rv, expr);
-			goto kill;
+		c->state = CONN_BODY;
+	}
+}
+
+
+/** Write out as much of the reply as possible.
+ * Returns 0 when done, 1 if there's more to write, -1 on errors. */
+static int write_client(int ci)
+{
+	struct client *c = clients + ci;
+	int rv;
+
+	while (c->out_pos < c->out_len) {
+		rv = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 1;
+		if (rv <= 0) {
+			log_error("write failed: %s (%d)", strerror(errno), errno);
+			return -1;
 		}
+
+		c->out_pos += rv;
+		conn_touch(ci);
 	}
 
+	return 0;
+}
+
 
-	/* For CMD_GRANT and CMD_REVOKE:
-	 * Don't close connection immediately, but send
-	 * result a second later? */
-	switch (ntohl(msg.header.cmd)) {
+static void answer_client(int ci)
+{
+	struct boothc_ticket_msg *msg = clients[ci].msg;
+
+	switch (ntohl(msg->header.cmd)) {
 	case CMD_LIST:
-		ticket_answer_list(fd, &msg);
-		goto kill;
+		ticket_answer_list(ci, msg);
+		break;
 
 	case CMD_GRANT:
-		/* Expect boothc_ticket_site_msg. */
-		if (len != sizeof(msg))
-			goto bad_len;
-		ticket_answer_grant(fd, &msg);
-		goto kill;
+		ticket_answer_grant(ci, msg);
+		break;
 
 	case CMD_REVOKE:
-		/* Expect boothc_ticket_site_msg. */
-		if (len != sizeof(msg))
-			goto bad_len;
+		ticket_answer_revoke(ci, msg);
+		break;
 
-		ticket_answer_revoke(fd, &msg);
-		goto kill;
+	case CMD_MIGRATE:
+		ticket_answer_migrate(ci, msg);
+		break;
+
+	case CMD_PEERS:
+		peers_answer_list(ci, msg);
+		break;
+
+	case CMD_STATS:
+		ticket_answer_stats(ci, msg);
+		break;
 
 	default:
 		log_error("connection %d cmd %x unknown",
-				ci, ntohl(msg.header.cmd));
-		init_header(&msg.header,CMR_GENERAL, 0, 0, RLT_INVALID_ARG, 0, sizeof(msg.header));
-		send_header_only(fd, &msg.header);
-		goto kill;
+				ci, ntohl(msg->header.cmd));
+		init_header(&msg->header,CMR_GENERAL, 0, 0, RLT_INVALID_ARG, 0, sizeof(msg->header));
+		send_header_only(ci, &msg->header);
+		break;
 	}
+}
+
 
-	assert(0);
-	return;
+/** Callback for client connections.
+ * The sockets are non-blocking; depending on the state we read the
+ * request, write the answer, or wait for the client to close the
+ * connection. */
+void process_connection(int ci)
+{
+	struct client *c = clients + ci;
+	char buf[64];
+	int rv;
+
+
+	switch (c->state) {
+	case CONN_HEADER:
+	case CONN_BODY:
+		rv = read_client(ci);
+		if (rv <= 0)
+			break;
 
-kill:
-	deadfn = clients[ci].deadfn;
-	if(deadfn) {
-		deadfn(ci);
+		answer_client(ci);
+		if (c->wait_tk) {
+			c->state = CONN_WAIT;
+			conn_unlink(ci);
+			break;
+		}
+
+		c->state = CONN_REPLY;
+		/* Try to send it right away; usually the answer fits
+		 * into the socket buffer. */
+		rv = write_client(ci);
+		if (rv == 1)
+			client_want_write(ci, 1);
+		break;
+
+	case CONN_REPLY:
+		rv = write_client(ci);
+		if (rv == 0)
+			client_want_write(ci, 0);
+		break;
+
+	case CONN_WAIT:
+	case CONN_CLOSING:
+		/* Discard anything the client still sends, until EOF. */
+		do {
+			rv = read(c->fd, buf, sizeof(buf));
+		} while (rv > 0 || (rv == -1 && errno == EINTR));
+		rv = (rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) ?
+			1 : -1;
+		break;
+
+	default:
+		assert(0);
+		rv = -1;
 	}
-	return;
+
+	if (rv == 0 && c->state == CONN_REPLY) {
+		/* Everything sent. Don't just close the socket: unread
+		 * data would cause a reset, which might make the client
+		 * miss the answer. */
+		c->state = CONN_CLOSING;
+		shutdown(c->fd, SHUT_WR);
+	}
+
+	if (rv < 0)
+		c->deadfn(ci);
 }
 
 
-/** Callback function for the listening TCP socket. */
-static void process_listener(int ci)
+/** Send the answer that was queued for a waiting connection. */
+void client_resume(int ci)
 {
-	int fd, i;
-
-	fd = accept(clients[ci].fd, NULL, NULL);
-	if (fd < 0) {
-		log_error("process_listener: accept error for fd %d: %s (%d)",
-			  clients[ci].fd, strerror(errno), errno);
-		if (clients[ci].deadfn)
-			clients[ci].deadfn(ci);
-		return;
-	}
+	struct client *c = clients + ci;
 
-	i = client_add(fd, clients[ci].transport, process_connection, NULL);
+	c->wait_tk = NULL;
+	c->state = CONN_REPLY;
+	conn_touch(ci);
 
-	log_debug("add client connection %d fd %d", i, fd);
+	switch (write_client(ci)) {
+	case 0:
+		c->state = CONN_CLOSING;
+		shutdown(c->fd, SHUT_WR);
+		break;
+	case 1:
+		client_want_write(ci, 1);
+		break;
+	default:
+		c->deadfn(ci);
+	}
 }
 
+
 static int setup_config(int type)
 {
 	int rv;
@@ -436,19 +737,20 @@ static int loop(int fd)
 {
 	void (*workfn) (int ci);
 	void (*deadfn) (int ci);
-	int rv, i;
+	struct epoll_event events[EPOLL_EVENTS_MAX];
+	int rv, i, ci, timeout;
 
 	rv = setup_transport();
 	if (rv < 0)
 		goto fail;
 
-	rv = setup_ticket();
+	rv = handler_init();
 	if (rv < 0)
 		goto fail;
 
-
-	client_add(local->tcp_fd, booth_transport + TCP,
-			process_listener, NULL);
+	rv = setup_ticket();
+	if (rv < 0)
+		goto fail;
 
 
 	rv = write_daemon_state(fd, BOOTHD_STARTED);
@@ -463,32 +765,55 @@ static int loop(int fd)
 			local->site_id, local->site_id);
 
 	while (1) {
-		rv = poll(pollfds, client_maxi + 1, poll_timeout);
+		/* Whatever the last round queued for the peers. */
+		booth_udp_flush();
+
+		/* Sleep until the next ticket, connection or handler
+		 * is due. */
+		timeout = tickets_next_timeout();
+		rv = client_conn_timeout();
+		if (timeout < 0 || (rv >= 0 && rv < timeout))
+			timeout = rv;
+		rv = handler_next_timeout();
+		if (timeout < 0 || (rv >= 0 && rv < timeout))
+			timeout = rv;
+		rv = peers_next_timeout();
+		if (timeout < 0 || (rv >= 0 && rv < timeout))
+			timeout = rv;
+
+		rv = epoll_wait(epoll_fd, events, EPOLL_EVENTS_MAX, timeout);
 		if (rv == -1 && errno == EINTR)
 			continue;
 		if (rv < 0) {
-			log_error("poll failed: %s (%d)", strerror(errno), errno);
+			log_error("epoll_wait failed: %s (%d)", strerror(errno), errno);
 			goto fail;
 		}
 
-		for (i = 0; i <= client_maxi; i++) {
-			if (clients[i].fd < 0)
+		for (i = 0; i < rv; i++) {
+			ci = events[i].data.u32;
+			if (clients[ci].fd < 0)
 				continue;
 
-			if (pollfds[i].revents & POLLIN) {
-				workfn = clients[i].workfn;
+			if (events[i].events & (EPOLLIN | EPOLLOUT)) {
+				workfn = clients[ci].workfn;
 				if (workfn)
-					workfn(i);
+					workfn(ci);
 			}
-			if (pollfds[i].revents &
-					(POLLERR | POLLHUP | POLLNVAL)) {
-				deadfn = clients[i].deadfn;
+			/* The work function might have closed it already. */
+			if (clients[ci].fd >= 0 &&
+					(events[i].events & (EPOLLERR | EPOLLHUP))) {
+				deadfn = clients[ci].deadfn;
 				if (deadfn)
-					deadfn(i);
+					deadfn(ci);
 			}
 		}
 
+		process_conn_timeouts();
+		process_handler_timeouts();
+		process_peer_timeouts();
+		client_reuse_released();
 		process_tickets();
+		store_flush();
 	}
 
 	return 0;
@@ -562,6 +887,8 @@ static int test_reply(int reply_code, cmd_request_t cmd)
 		op_str = "grant";
 	else if (cmd == CMD_REVOKE)
 		op_str = "revoke";
+	else if (cmd == CMD_MIGRATE)
+		op_str = "migrate";
 	else {
 		log_error("internal error reading reply result!");
 		return -1;
@@ -570,8 +897,8 @@ static int test_reply(int reply_code, cmd_request_t cmd)
 	switch (reply_code) {
 	case RLT_OVERGRANT:
 		log_info("You're granting a granted ticket. "
-			 "If you wanted to migrate a ticket, "
-			 "use revoke first, then use grant.");
+			 "If you wanted to move a ticket, "
+			 "use migrate.");
 		rv = -1;
 		break;
 
@@ -647,6 +974,11 @@ static int do_command(cmd_request_t cmd)
 
 	assert(site->type == SITE);
 
+	/* The site asked is the one the ticket should go to; it
+	 * redirects to the leader. */
+	if (cmd == CMD_MIGRATE)
+		cl.msg.ticket.leader = htonl(get_node_id(site));
+
 	/* We don't check for existence of ticket, so that asking can be
 	 * done without local configuration, too.
 	 * Although, that means that the UDP port has to be specified, too. */
@@ -704,6 +1036,11 @@ static int do_revoke(void)
 	return do_command(CMD_REVOKE);
 }
 
+static int do_migrate(void)
+{
+	return do_command(CMD_MIGRATE);
+}
+
 
 
 static int _lockfile(int mode, int *fdp, pid_t *locked_by)
@@ -805,13 +1142,16 @@ static void print_usage(void)
 {
 	printf("Usages:\n");
 	printf("  booth daemon [-c config] [-D]\n");
-	printf("  booth [client] {list|grant|revoke} [options]\n");
+	printf("  booth [client] {list|peers|stats|grant|revoke|migrate} [options]\n");
 	printf("  booth status [-c config] [-D]\n");
 	printf("\n");
 	printf("Client operations:\n");
 	printf("  list:	        List all the tickets\n");
+	printf("  peers:        List the sites and whether they're reachable\n");
+	printf("  stats:        Show some counters of the daemon\n");
 	printf("  grant:        Grant ticket to site\n");
 	printf("  revoke:       Revoke ticket from site\n");
+	printf("  migrate:      Move ticket to site, without elections\n");
 	printf("\n");
 	printf("Options:\n");
 	printf("  -c FILE       Specify config file [default " BOOTH_DEFAULT_CONF "]\n");
@@ -911,10 +1251,16 @@ static int read_arguments(int argc, char **argv)
     if (cl.type == CLIENT) {
 		if (!strcmp(op, "list"))
 			cl.op = CMD_LIST;
+		else if (!strcmp(op, "peers"))
+			cl.op = CMD_PEERS;
+		else if (!strcmp(op, "stats"))
+			cl.op = CMD_STATS;
 		else if (!strcmp(op, "grant"))
 			cl.op = CMD_GRANT;
 		else if (!strcmp(op, "revoke"))
 			cl.op = CMD_REVOKE;
+		else if (!strcmp(op, "migrate"))
+			cl.op = CMD_MIGRATE;
 		else {
 			fprintf(stderr, "client operation \"%s\" is unknown\n",
 					op);
@@ -962,7 +1308,8 @@ static int read_arguments(int argc, char **argv)
 			safe_copy(cl.lockfile, optarg, sizeof(cl.lockfile), "lock file");
 			break;
 		case 't':
-			if (cl.op == CMD_GRANT || cl.op == CMD_REVOKE) {
+			if (cl.op == CMD_GRANT || cl.op == CMD_REVOKE ||
+					cl.op == CMD_MIGRATE) {
 				safe_copy(cl.msg.ticket.id, optarg,
 						sizeof(cl.msg.ticket.id), "ticket name");
 			} else {
@@ -1308,6 +1655,14 @@ static int do_client(void)
 		rv = query_get_string_answer(CMD_LIST);
 		break;
 
+	case CMD_PEERS:
+		rv = query_get_string_answer(CMD_PEERS);
+		break;
+
+	case CMD_STATS:
+		rv = query_get_string_answer(CMD_STATS);
+		break;
+
 	case CMD_GRANT:
 		rv = do_grant();
 		break;
@@ -1315,6 +1670,10 @@ static int do_client(void)
 	case CMD_REVOKE:
 		rv = do_revoke();
 		break;
+
+	case CMD_MIGRATE:
+		rv = do_migrate();
+		break;
 	}
 
 out:
@@ -19,8 +19,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include "log.h"
@@ -314,27 +317,326 @@ static int pcmk_load_ticket(struct ticket_config *tk)
 
 	rv = crm_ticket_get(tk, "owner", &v);
 	if (!rv) {
-		/* No check, node could have been deconfigured. */
-		if (!find_site_by_id(v, &tk->leader)) {
-			/* Hmm, no site found for the ticket we have in the
-			 * CIB!?
-			 * Assume that the ticket belonged to us if it was
-			 * granted here!
-			 */
-			tk_log_warn("no site matches; site got reconfigured?");
-			if (tk->is_granted) {
-				tk_log_warn("granted here, assume it belonged to us");
-				tk->leader = local;
+		store_loaded_owner(tk, v);
+	}
+
+	return rv;
+}
+
+
+/** Get the value of an XML attribute within [start, end).
+ * Values are plain numbers or words, so no unescaping is done. */
+static int xml_attr_get(const char *start, const char *end,
+		const char *attr, char *buf, int len)
+{
+	const char *cp, *val, *q;
+	int alen = strlen(attr);
+
+	for (cp = start; (cp = strstr(cp, attr)) && cp < end; cp += alen) {
+		if (!isspace(cp[-1]) || cp[alen] != '=')
+			continue;
+
+		val = cp + alen + 1;
+		if (*val != '"' && *val != '\'')
+			continue;
+		q = strchr(val + 1, *val);
+		if (!q || q >= end || q - val - 1 >= len)
+			return ENODATA;
+
+		memcpy(buf, val + 1, q - val - 1);
+		buf[q - val - 1] = '\0';
+		return 0;
+	}
+
+	return ENODATA;
+}
+
+
+static int xml_attr_int(const char *start, const char *end,
+		const char *attr, int64_t *data)
+{
+	char buf[32];
+	int rv;
+
+	rv = xml_attr_get(start, end, attr, buf, sizeof(buf));
+	if (rv)
+		return rv;
+
+	if (!strcmp(buf, "false"))
+		*data = 0;
+	else if (!strcmp(buf, "true"))
+		*data = 1;
+	else if (sscanf(buf, "%" SCNi64, data) != 1)
+		return EINVAL;
+	return 0;
+}
+
+
+/** Load the ticket attributes from a <ticket_state> element. */
+static int parse_ticket_state(struct ticket_config *tk,
+		const char *start, const char *end)
+{
+	int rv;
+	int64_t v;
+
+	rv = xml_attr_int(start, end, "expires", &v);
+	if (!rv) {
+		tk->term_expires = unwall_ts(v);
+	}
+
+	rv = xml_attr_int(start, end, "term", &v);
+	if (!rv) {
+		tk->current_term = v;
+	}
+
+	rv = xml_attr_int(start, end, "granted", &v);
+	if (!rv) {
+		tk->is_granted = v;
+	}
+
+	rv = xml_attr_int(start, end, "owner", &v);
+	if (!rv) {
+		store_loaded_owner(tk, v);
+	}
+
+	/* Asking crm_ticket wouldn't find more. */
+	return rv ? ENOENT : 0;
+}
+
+
+/** Reads the <tickets> of the CIB status section into a new buffer.
+ * Returns the exit status of cibadmin, or a negative errno. */
+static int cib_query_tickets(char **out)
+{
+	const char *cmd = "cibadmin --query --xpath '/cib/status/tickets' "
+		"2> /dev/null";
+	char *data = NULL, *buf;
+	int rv, len, alloc;
+	FILE *p;
+
+
+	p = popen(cmd, "r");
+	if (p == NULL) {
+		log_error("popen error %d (%s) for \"%s\"",
+				errno, strerror(errno), cmd);
+		return -EINVAL;
+	}
+
+	len = 0;
+	alloc = 0;
+	do {
+		if (alloc - len < 4096) {
+			alloc = alloc ? alloc * 2 : 16384;
+			buf = realloc(data, alloc);
+			if (!buf) {
+				log_error("out of memory for the CIB tickets");
+				pclose(p);
+				free(data);
+				return -ENOMEM;
+			}
+			data = buf;
+		}
+		rv = fread(data + len, 1, alloc - len - 1, p);
+		len += rv;
+	} while (rv > 0);
+	data[len] = '\0';
+
+	rv = pclose(p);
+	log_debug("command \"%s\" returned %s, %d bytes", cmd,
+			interpret_rv(rv), len);
+	if (rv) {
+		free(data);
+		return rv;
+	}
+
+	*out = data;
+	return 0;
+}
+
+
+/** Finds the <ticket_state> element of a ticket in a CIB query result;
+ * returns its start, and its end via \a end, or NULL. */
+static char *find_ticket_state(char *data, const char *name, char **end)
+{
+	char id[BOOTH_NAME_LEN], *start;
+
+	for (start = data; (start = strstr(start, "<ticket_state")); start = *end) {
+		*end = strchr(start, '>');
+		if (!*end)
+			break;
+
+		if (!xml_attr_get(start, *end, "id", id, sizeof(id)) &&
+				!strcmp(name, id))
+			return start;
+	}
+
+	return NULL;
+}
+
+
+/** Loads all tickets with a single CIB query.
+ * Tickets that are not in the CIB get ENOENT; if the query
+ * can't be done, the results are left at EAGAIN, so that the tickets
+ * get loaded one by one. */
+static int pcmk_load_tickets(struct ticket_config **tks, int count, int *res)
+{
+	char *data = NULL, *start, *end;
+	char id[BOOTH_NAME_LEN];
+	int i, rv;
+
+
+	test_atomicity();
+
+	for (i = 0; i < count; i++)
+		res[i] = EAGAIN;
+
+	rv = cib_query_tickets(&data);
+	if (rv) {
+		log_info("loading all tickets at once failed (%s), "
+				"loading them one by one", interpret_rv(rv));
+		return rv;
+	}
+
+	/* Not found means "no state". */
+	for (i = 0; i < count; i++) {
+		/* These might be escaped in the XML. */
+		if (!strpbrk(tks[i]->name, "'\"<>&"))
+			res[i] = ENOENT;
+	}
+
+	for (start = data; (start = strstr(start, "<ticket_state")); start = end) {
+		end = strchr(start, '>');
+		if (!end)
+			break;
+
+		if (xml_attr_get(start, end, "id", id, sizeof(id)))
+			continue;
+
+		for (i = 0; i < count; i++) {
+			if (!strcmp(tks[i]->name, id)) {
+				res[i] = parse_ticket_state(tks[i], start, end);
+				break;
 			}
 		}
 	}
 
+	free(data);
+	return 0;
+}
+
+
+static int pcmk_write_ticket(struct ticket_config *tk)
+{
+	if (tk->leader == local)
+		return pcmk_grant_ticket(tk);
+	else
+		return pcmk_revoke_ticket(tk);
+}
+
+
+/** Writes several tickets with one CIB update.
+ * The ticket states are put into the status section in a single
+ * cibadmin call, ie. one transaction; if that fails, the tickets are
+ * written one by one, to get a result for each of them.
+ * Like "crm_ticket -g", a grant sets "last-granted" if the ticket
+ * wasn't granted in the CIB yet; that needs a query beforehand. */
+static int pcmk_write_tickets(struct ticket_config **tks, int count, int *res)
+{
+	char *cmd, *cp, *data = NULL, *start, *end;
+	char last_granted[48];
+	int i, rv, alloc;
+	int64_t granted;
+
+
+	if (count == 1)
+		goto single;
+
+	for (i = 0; i < count; i++) {
+		/* Would need quoting. */
+		if (strpbrk(tks[i]->name, "'\"<>&"))
+			goto single;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (tks[i]->leader == local)
+			break;
+	}
+	if (i < count) {
+		rv = cib_query_tickets(&data);
+		if (rv) {
+			log_warn("cannot query the CIB tickets (%s), "
+					"writing them one by one",
+					interpret_rv(rv));
+			goto single;
+		}
+	}
+
+	alloc = 128 + count * (BOOTH_NAME_LEN + 160);
+	cmd = malloc(alloc);
+	if (!cmd) {
+		free(data);
+		goto single;
+	}
+
+	cp = cmd + sprintf(cmd,
+			"cibadmin --modify --allow-create --scope status "
+			"--xml-text '<tickets>");
+	for (i = 0; i < count; i++) {
+		last_granted[0] = '\0';
+		if (tks[i]->leader == local) {
+			start = find_ticket_state(data, tks[i]->name, &end);
+			if (!start ||
+					xml_attr_int(start, end, "granted", &granted) ||
+					!granted)
+				sprintf(last_granted, "last-granted=\"%" PRIi64 "\" ",
+						(int64_t)time(NULL));
+		}
+
+		cp += sprintf(cp,
+				"<ticket_state id=\"%s\" granted=\"%s\" %s"
+				"owner=\"%" PRIi32 "\" "
+				"expires=\"%" PRIi64 "\" "
+				"term=\"%" PRIi64 "\"/>",
+				tks[i]->name,
+				tks[i]->leader == local ? "true" : "false",
+				last_granted,
+				(int32_t)get_node_id(tks[i]->leader),
+				(int64_t)wall_ts(tks[i]->term_expires),
+				(int64_t)tks[i]->current_term);
+	}
+	free(data);
+	strcpy(cp, "</tickets>'");
+
+	rv = system(cmd);
+	log_debug("command: '%s' was executed", cmd);
+	free(cmd);
+
+	if (rv == 0) {
+		log_info("%d tickets written to the CIB", count);
+		for (i = 0; i < count; i++)
+			res[i] = 0;
+		return 0;
+	}
+
+	log_warn("writing %d tickets at once failed (%s), "
+			"writing them one by one",
+			count, interpret_rv(rv));
+
+single:
+	rv = 0;
+	for (i = 0; i < count; i++) {
+		res[i] = pcmk_write_ticket(tks[i]);
+		rv = rv || res[i];
+	}
 	return rv;
 }
 
 
 struct ticket_handler pcmk_handler = {
+	.name           = "pacemaker",
 	.grant_ticket   = pcmk_grant_ticket,
 	.revoke_ticket  = pcmk_revoke_ticket,
 	.load_ticket    = pcmk_load_ticket,
+	.load_tickets   = pcmk_load_tickets,
+	.write_tickets  = pcmk_write_tickets,
 };
@@ -22,14 +22,8 @@
 
 #include <stdint.h>
 #include "config.h"
+#include "store.h"
 
-struct ticket_handler {
-	int (*grant_ticket) (struct ticket_config *tk);
-	int (*revoke_ticket) (struct ticket_config *tk);
-	int (*load_ticket) (struct ticket_config *tk);
-};
-
-struct ticket_handler pcmk_handler;
 const char * interpret_rv(int rv);
 
 
@@ -38,7 +38,8 @@ inline static void clear_election(struct ticket_config *tk)
 	struct booth_site *site;
 
 	tk_log_debug("clear election");
-	tk->votes_received = 0;
+	tk->tie_deferred = 0;
+	siteset_clear(tk->votes_received);
 	foreach_node(i, site)
 		tk->votes_for[site->index] = NULL;
 }
@@ -54,7 +55,7 @@ inline static void record_vote(struct ticket_config *tk,
 
 	if (!tk->votes_for[who->index]) {
 		tk->votes_for[who->index] = vote;
-		tk->votes_received |= who->bitmask;
+		siteset_add(tk->votes_received, who);
 	} else {
 		if (tk->votes_for[who->index] != vote)
 			tk_log_warn("%s voted previously "
@@ -67,23 +68,21 @@ inline static void record_vote(struct ticket_config *tk,
 
 
 static int cmp_msg_ticket(struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg)
+		const struct peer_msg *msg)
 {
-	if (my_last_term(tk) != ntohl(msg->ticket.term)) {
-		return my_last_term(tk) - ntohl(msg->ticket.term);
+	if (my_last_term(tk) != msg->term) {
+		return my_last_term(tk) - msg->term;
 	}
 	return 0;
 }
 
 static void update_term_from_msg(struct ticket_config *tk,
-		struct boothc_ticket_msg *msg)
+		const struct peer_msg *msg)
 {
 	uint32_t i;
 
 
-	i = ntohl(msg->ticket.term);
+	i = msg->term;
 	/* if we failed to start the election, then accept the term
 	 * from the leader
 	 * */
@@ -96,30 +95,44 @@ static void update_term_from_msg(struct ticket_config *tk,
 
 
 static void update_ticket_from_msg(struct ticket_config *tk,
-		struct booth_site *sender,
-		struct boothc_ticket_msg *msg)
+		const struct peer_msg *msg)
 {
 	int duration;
 
 	tk_log_debug("updating from %s (%d/%d)",
-		site_string(sender),
-		ntohl(msg->ticket.term), ntohl(msg->ticket.term_valid_for));
-	duration = min(tk->term_duration, ntohl(msg->ticket.term_valid_for));
+		site_string(msg->sender),
+		msg->term, msg->term_valid_for);
+	duration = min(tk->term_duration, msg->term_valid_for);
 	tk->term_expires = get_secs(NULL) + duration;
 	update_term_from_msg(tk, msg);
 }
 
 
 static void copy_ticket_from_msg(struct ticket_config *tk,
-		struct boothc_ticket_msg *msg)
+		const struct peer_msg *msg)
 {
-	tk->term_expires = get_secs(NULL) + ntohl(msg->ticket.term_valid_for);
-	tk->current_term = ntohl(msg->ticket.term);
+	tk->term_expires = get_secs(NULL) + msg->term_valid_for;
+	tk->current_term = msg->term;
 }
 
+/* There's a leader again; count the election rounds it took us. */
+static void elections_done(struct ticket_config *tk)
+{
+	if (!tk->election_rounds)
+		return;
+
+	tk_log_debug("elections done after %d round(s)",
+			tk->election_rounds);
+	ticket_stats.elections++;
+	ticket_stats.election_rounds += tk->election_rounds;
+	tk->election_rounds = 0;
+}
+
+
 static void become_follower(struct ticket_config *tk,
-		struct boothc_ticket_msg *msg)
+		const struct peer_msg *msg)
 {
+	elections_done(tk);
 	copy_ticket_from_msg(tk, msg);
 	tk->state = ST_FOLLOWER;
 	tk->delay_commit = 0;
@@ -136,6 +149,7 @@ static void become_follower(struct ticket_config *tk,
 
 static void won_elections(struct ticket_config *tk)
 {
+	elections_done(tk);
 	tk->leader = local;
 	tk->state = ST_LEADER;
 
@@ -148,13 +162,17 @@ static void won_elections(struct ticket_config *tk)
 }
 
 
-static int is_tie(struct ticket_config *tk)
+/* Returns the tied candidate that goes first by weight, or NULL if
+ * there's no tie. */
+static struct booth_site *is_tie(struct ticket_config *tk)
 {
 	int i;
-	struct booth_site *v;
-	int count[MAX_NODES] = { 0, };
+	struct booth_site *v, *first = NULL;
+	int count[booth_conf->site_count];
 	int max_votes = 0, max_cnt = 0;
 
+	memset(count, 0, sizeof(count));
+
 	for(i=0; i<booth_conf->site_count; i++) {
 		v = tk->votes_for[i];
 		if (!v)
@@ -164,19 +182,24 @@ static int is_tie(struct ticket_config *tk)
 	}
 
 	for(i=0; i<booth_conf->site_count; i++) {
-		if (count[i] == max_votes)
-			max_cnt++;
+		if (count[i] != max_votes)
+			continue;
+		max_cnt++;
+		v = booth_conf->site + i;
+		if (!first || site_outranks(tk, v, first))
+			first = v;
 	}
 
-	return max_cnt > 1;
+	return max_cnt > 1 ? first : NULL;
 }
 
 static struct booth_site *majority_votes(struct ticket_config *tk)
 {
 	int i, n;
 	struct booth_site *v;
-	int count[MAX_NODES] = { 0, };
+	int count[booth_conf->site_count];
 
+	memset(count, 0, sizeof(count));
 
 	for(i=0; i<booth_conf->site_count; i++) {
 		v = tk->votes_for[i];
@@ -207,7 +230,7 @@ static struct booth_site *majority_votes(struct ticket_config *tk)
 void elections_end(struct ticket_config *tk)
 {
 	time_t now;
-	struct booth_site *new_leader;
+	struct booth_site *new_leader, *first;
 
 	now = get_secs(NULL);
 	if (now > tk->election_end) {
@@ -224,8 +247,24 @@ void elections_end(struct ticket_config *tk)
 		tk_log_info("ticket granted at %s",
 				site_string(new_leader));
 	} else {
+		first = is_tie(tk);
+		if (first && first != local && !tk->tie_deferred) {
+			/* If all tied candidates went for the next term at
+			 * once, it might split again; let the one that goes
+			 * first by weight do it, and vote for it then. Try
+			 * ourselves only if it doesn't within a timeout. */
+			tk_log_info("tie with %s, waiting for it to "
+					"start new elections",
+					site_string(first));
+			tk->tie_deferred = 1;
+			tk->election_end = max(tk->election_end, now) +
+				tk->timeout;
+			no_resends(tk);
+			set_ticket_wakeup(tk);
+			return;
+		}
 		tk_log_info("nobody won elections, new elections");
-		if (!new_election(tk, NULL, is_tie(tk), OR_AGAIN)) {
+		if (!new_election(tk, NULL, first != NULL, OR_AGAIN)) {
 			ticket_activate_timeout(tk);
 		}
 	}
@@ -233,30 +272,28 @@ void elections_end(struct ticket_config *tk)
 
 
 static int newer_term(struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg,
+		const struct peer_msg *msg,
 		int in_election)
 {
 	uint32_t term;
 
 	/* it may happen that we hear about our newer term */
-	if (leader == local)
+	if (msg->leader == local)
 		return 0;
 
-	term = ntohl(msg->ticket.term);
+	term = msg->term;
 	/* §5.1 */
 	if (term > tk->current_term) {
 		tk->state = ST_FOLLOWER;
 		if (!in_election) {
-			tk->leader = leader;
+			tk->leader = msg->leader;
 			tk_log_info("from %s: higher term %d vs. %d, following %s",
-					site_string(sender),
+					site_string(msg->sender),
 					term, tk->current_term,
 					ticket_leader_string(tk));
 		} else {
 			tk_log_debug("from %s: higher term %d vs. %d (election)",
-					site_string(sender),
+					site_string(msg->sender),
 					term, tk->current_term);
 		}
 
@@ -268,20 +305,18 @@ static int newer_term(struct ticket_config *tk,
 }
 
 static int term_too_low(struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg)
+		const struct peer_msg *msg)
 {
 	uint32_t term;
 
-	term = ntohl(msg->ticket.term);
+	term = msg->term;
 	/* §5.1 */
 	if (term < tk->current_term) {
 		tk_log_info("sending reject to %s, its term too low "
-			"(%d vs. %d)", site_string(sender),
+			"(%d vs. %d)", site_string(msg->sender),
 			term, tk->current_term
 			);
-		send_reject(sender, tk, RLT_TERM_OUTDATED, msg);
+		send_reject(msg->sender, tk, RLT_TERM_OUTDATED, msg);
 		return 1;
 	}
 
@@ -291,30 +326,92 @@ static int term_too_low(struct ticket_config *tk,
 
 
 
+static int ticket_seems_ok(struct ticket_config *tk)
+{
+	int time_left;
+
+	time_left = term_time_left(tk);
+	if (!time_left)
+		return 0; /* quite sure */
+	if (tk->state == ST_CANDIDATE)
+		return 0; /* in state of flux */
+	if (tk->state == ST_LEADER)
+		return 1; /* quite sure */
+	if (tk->state == ST_FOLLOWER &&
+			time_left >= tk->term_duration/3)
+		return 1; /* almost quite sure */
+	return 0;
+}
+
+
+static int unexpected_msg(
+		struct ticket_config *tk,
+		const struct peer_msg *msg
+	       )
+{
+	tk_log_warn("unexpected message %s, from %s",
+		state_to_string(msg->cmd),
+		site_string(msg->sender));
+	if (ticket_seems_ok(tk))
+		send_reject(msg->sender, tk, RLT_TERM_STILL_VALID, msg);
+	return -EINVAL;
+}
+
+
+static int write_pending(struct ticket_config *tk)
+{
+	return tk->cib_dirty || tk->cib_busy || tk->update_cib;
+}
+
+/* The sender of an UPDATE, REVOKE or handover request counts on the
+ * new state being in our CIB once we ack; so if it isn't written yet,
+ * the ack waits for raft_ticket_written(). */
+static int ack_when_written(struct ticket_config *tk,
+		const struct peer_msg *msg)
+{
+	if (local->type != SITE || !write_pending(tk))
+		return send_msg(OP_ACK, tk, msg->sender, msg);
+
+	tk_log_debug("ack to %s when the ticket is written",
+			site_string(msg->sender));
+	tk->cib_ack_to = msg->sender;
+	tk->cib_ack_request = msg->cmd;
+	return 0;
+}
+
 /* For follower. */
 static int answer_HEARTBEAT (
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 	       )
 {
 	uint32_t term;
 
-	term = ntohl(msg->ticket.term);
+	if ((tk->leader == local && term_time_left(tk)) ||
+			tk->state == ST_LEADER)
+		return unexpected_msg(tk, msg);
+
+	if (promised_elsewhere(tk, msg->sender, msg->term)) {
+		tk_log_warn("heartbeat from %s, but we promised "
+				"the next term to %s, sending reject",
+			site_string(msg->sender), site_string(tk->successor));
+		return send_reject(msg->sender, tk, RLT_TERM_OUTDATED, msg);
+	}
+
+	term = msg->term;
 	tk_log_debug("heartbeat from leader: %s, have %s; term %d vs %d",
-			site_string(leader), ticket_leader_string(tk),
+			site_string(msg->leader), ticket_leader_string(tk),
 			term, tk->current_term);
 
 	if (term < tk->current_term) {
-		if (sender == tk->leader) {
+		if (msg->sender == tk->leader) {
 			tk_log_info("trusting leader %s with a lower term (%d vs %d)",
-				site_string(leader), term, tk->current_term);
+				site_string(msg->leader), term, tk->current_term);
 		} else if (is_owned(tk)) {
 			tk_log_warn("different leader %s with a lower term "
 					"(%d vs %d), sending reject",
-				site_string(leader), term, tk->current_term);
-			return send_reject(sender, tk, RLT_TERM_OUTDATED, msg);
+				site_string(msg->leader), term, tk->current_term);
+			return send_reject(msg->sender, tk, RLT_TERM_OUTDATED, msg);
 		}
 	}
 
@@ -322,98 +419,171 @@ static int answer_HEARTBEAT (
 	tk->expect_more_rejects = 0;
 
 	/* Needed? */
-	newer_term(tk, sender, leader, msg, 0);
+	newer_term(tk, msg, 0);
 
 	become_follower(tk, msg);
 	/* Racy??? */
-	assert(sender == leader || !leader);
+	assert(msg->sender == msg->leader || !msg->leader);
 
-	tk->leader = leader;
+	tk->leader = msg->leader;
 
 	/* Ack the heartbeat (we comply). */
-	return send_msg(OP_ACK, tk, sender, msg);
+	return send_msg(OP_ACK, tk, msg->sender, msg);
 }
 
 
 static int process_UPDATE (
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 	       )
 {
-	if (is_owned(tk) && sender != tk->leader) {
+	if (((tk->leader == local || tk->leader != msg->leader) &&
+				is_owned(tk)) ||
+			tk->state == ST_LEADER)
+		return unexpected_msg(tk, msg);
+
+	if (is_owned(tk) && msg->sender != tk->leader) {
 		tk_log_warn("different leader %s wants to update "
 				"our ticket, sending reject",
-			site_string(leader));
-		return send_reject(sender, tk, RLT_TERM_OUTDATED, msg);
+			site_string(msg->leader));
+		return send_reject(msg->sender, tk, RLT_TERM_OUTDATED, msg);
+	}
+
+	if (promised_elsewhere(tk, msg->sender, msg->term)) {
+		tk_log_warn("%s wants to update our ticket, but we promised "
+				"the next term to %s, sending reject",
+			site_string(msg->sender), site_string(tk->successor));
+		return send_reject(msg->sender, tk, RLT_TERM_OUTDATED, msg);
 	}
 
 	tk_log_debug("leader %s wants to update our ticket",
-			site_string(leader));
+			site_string(msg->leader));
 
-	tk->leader = leader;
+	tk->leader = msg->leader;
 	copy_ticket_from_msg(tk, msg);
 	ticket_write(tk);
 
 	/* run ticket_cron if the ticket expires */
 	set_ticket_wakeup(tk);
 
-	return send_msg(OP_ACK, tk, sender, msg);
+	return ack_when_written(tk, msg);
 }
 
 static int process_REVOKE (
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 	       )
 {
 	int rv;
 
 	if (tk->state == ST_INIT && tk->leader == no_leader) {
 		/* assume that our ack got lost */
-		rv = send_msg(OP_ACK, tk, sender, msg);
-	} else if (tk->leader != sender) {
+		rv = ack_when_written(tk, msg);
+	} else if (tk->leader != msg->sender) {
 		tk_log_error("%s wants to revoke ticket, "
 				"but it is not granted there (ignoring)",
-				site_string(sender));
+				site_string(msg->sender));
 		return 1;
 	} else if (tk->state != ST_FOLLOWER) {
 		tk_log_error("unexpected ticket revoke from %s "
 				"(in state %s) (ignoring)",
-				site_string(sender),
+				site_string(msg->sender),
 				state_to_string(tk->state));
 		return 1;
 	} else {
 		tk_log_info("%s revokes ticket",
 				site_string(tk->leader));
 		reset_ticket(tk);
+		tk->successor = NULL;
 		tk->leader = no_leader;
 		ticket_write(tk);
-		rv = send_msg(OP_ACK, tk, sender, msg);
+		rv = ack_when_written(tk, msg);
 	}
 
 	return rv;
 }
 
 
+/* For the site handing the ticket over: the new leader may take the
+ * ticket once a majority knows about it, and once our own CIB has
+ * it revoked, see raft_ticket_written(). */
+static int takeover_due(struct ticket_config *tk)
+{
+	return tk->last_request == OP_HANDOVER &&
+		tk->state == ST_FOLLOWER &&
+		!write_pending(tk) &&
+		majority_of_sites(tk, tk->acks_received);
+}
+
+/* Only the new leader has to answer this one; see start_handover(). */
+static int send_takeover(struct ticket_config *tk)
+{
+	struct booth_site *n;
+	int i;
+
+	tk_log_info("majority agrees, %s can take over",
+			site_string(tk->leader));
+	tk->last_request = OP_TAKEOVER;
+	expect_replies(tk, OP_ACK);
+	foreach_node(i, n)
+		if (n != tk->leader)
+			siteset_add(tk->acks_received, n);
+	ticket_activate_timeout(tk);
+	return send_msg(OP_TAKEOVER, tk, tk->leader, NULL);
+}
+
+/* Called by store_write_done(). */
+void raft_ticket_written(struct ticket_config *tk, int rv)
+{
+	struct peer_msg req = { .cmd = tk->cib_ack_request };
+
+	if (tk->last_request == OP_HANDOVER && tk->state == ST_FOLLOWER) {
+		if (rv && !tk->cib_dirty) {
+			/* The ticket may still be granted here; nobody else
+			 * gets it before the term runs out. (A write that
+			 * is still queued has the revoke, and decides.) */
+			tk_log_error("can't revoke the ticket in the CIB, "
+					"not handing it over to %s",
+					site_string(tk->leader));
+			tk->last_request = 0;
+			no_resends(tk);
+			set_ticket_wakeup(tk);
+		} else if (takeover_due(tk)) {
+			send_takeover(tk);
+		}
+	}
+
+	/* On failure the write is retried, see ticket_write_done();
+	 * and if the ticket changed meanwhile, the newer state is what
+	 * we ack. */
+	if (rv || tk->cib_dirty || !tk->cib_ack_to)
+		return;
+
+	send_msg(OP_ACK, tk, tk->cib_ack_to, &req);
+	tk->cib_ack_to = NULL;
+}
+
+
 /* For leader. */
 static int process_ACK(
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 	       )
 {
 	uint32_t term;
 
-	term = ntohl(msg->ticket.term);
+	if (msg->request == OP_HANDOVER && takeover_due(tk))
+		return send_takeover(tk);
 
-	if (newer_term(tk, sender, leader, msg, 0)) {
+	if (tk->leader != local || tk->state != ST_LEADER)
+		return 0;
+
+	term = msg->term;
+
+	if (newer_term(tk, msg, 0)) {
 		/* unexpected higher term */
 		tk_log_warn("got higher term from %s (%d vs. %d)",
-				site_string(sender),
+				site_string(msg->sender),
 				term, tk->current_term);
 		return 0;
 	}
@@ -424,7 +594,7 @@ static int process_ACK(
 		 * doesn't receive our packets? */
 		tk_log_warn("unexpected term "
 				"from %s (%d vs. %d) (ignoring)",
-				site_string(sender),
+				site_string(msg->sender),
 				term, tk->current_term);
 		return 0;
 	}
@@ -437,9 +607,9 @@ static int process_ACK(
 	/* for heartbeats we make do with the majority */
 	if (tk->last_request == OP_HEARTBEAT &&
 			term == tk->current_term &&
-			leader == tk->leader) {
+			msg->leader == tk->leader) {
 
-		if (majority_of_bits(tk, tk->acks_received)) {
+		if (majority_of_sites(tk, tk->acks_received)) {
 			/* OK, at least half of the nodes are reachable;
 			 * Update the ticket and send update messages out
 			 */
@@ -451,15 +621,93 @@ static int process_ACK(
 }
 
 
+/* The leader gives the ticket to msg->leader in the next term; see
+ * start_handover(). The new leader itself waits for OP_TAKEOVER. */
+static int process_HANDOVER(
+		struct ticket_config *tk,
+		const struct peer_msg *msg
+		)
+{
+	if (msg->term == tk->current_term &&
+			msg->leader == tk->voted_for) {
+		/* assume that our ack got lost */
+		return ack_when_written(tk, msg);
+	}
+
+	if (msg->sender != tk->leader || msg->term <= tk->current_term ||
+			!msg->leader || msg->leader == no_leader) {
+		tk_log_warn("%s wants to hand the ticket over to %s, "
+				"but it is not the leader here (ignoring)",
+				site_string(msg->sender),
+				site_string(msg->leader));
+		return 0;
+	}
+
+	tk_log_info("%s hands the ticket over to %s",
+			site_string(msg->sender),
+			site_string(msg->leader));
+	tk->current_term = msg->term;
+	tk->voted_for = msg->leader;
+	tk->state = ST_FOLLOWER;
+	if (msg->leader != local) {
+		tk->leader = msg->leader;
+		tk->term_expires = get_secs(NULL) + msg->term_valid_for;
+		ticket_write(tk);
+		set_ticket_wakeup(tk);
+	}
+
+	return ack_when_written(tk, msg);
+}
+
+
+/* A majority took note of the handover, the ticket is ours. */
+static int process_TAKEOVER(
+		struct ticket_config *tk,
+		const struct peer_msg *msg
+		)
+{
+	if (tk->state == ST_LEADER && msg->term == tk->current_term) {
+		/* assume that our ack got lost */
+		return ack_when_written(tk, msg);
+	}
+
+	/* The handover itself got lost; this one implies it. */
+	if (msg->sender == tk->leader && msg->leader == local &&
+			msg->term > tk->current_term) {
+		tk_log_info("%s hands the ticket over to us (term %d)",
+				site_string(msg->sender), msg->term);
+		tk->current_term = msg->term;
+		tk->voted_for = local;
+	}
+
+	if (msg->sender != tk->leader || msg->term != tk->current_term ||
+			tk->voted_for != local) {
+		tk_log_warn("unexpected ticket takeover from %s (ignoring)",
+				site_string(msg->sender));
+		return 0;
+	}
+
+	tk_log_info("ticket handed over from %s",
+			site_string(msg->sender));
+	tk->leader = local;
+	tk->state = ST_LEADER;
+	tk->term_expires = get_secs(NULL) + tk->term_duration;
+	tk->delay_commit = 0;
+	tk->ticket_updated = 2;
+	ticket_write(tk);
+	set_ticket_wakeup(tk);
+
+	return ack_when_written(tk, msg);
+}
+
+
 static int process_VOTE_FOR(
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 		)
 {
 	/* leader wants to step down? */
-	if (leader == no_leader && sender == tk->leader &&
+	if (msg->leader == no_leader && msg->sender == tk->leader &&
 			(tk->state == ST_FOLLOWER || tk->state == ST_CANDIDATE)) {
 		tk_log_info("%s wants to give the ticket away",
 			site_string(tk->leader));
@@ -475,18 +723,18 @@ static int process_VOTE_FOR(
 	if (tk->state != ST_CANDIDATE) {
 		/* lost candidate status, somebody rejected our proposal */
 		tk_log_debug("candidate status lost, ignoring vote_for from %s",
-			site_string(sender));
+			site_string(msg->sender));
 		return 0;
 	}
 
-	if (term_too_low(tk, sender, leader, msg))
+	if (term_too_low(tk, msg))
 		return 0;
 
-	if (newer_term(tk, sender, leader, msg, 0)) {
+	if (newer_term(tk, msg, 0)) {
 		clear_election(tk);
 	}
 
-	record_vote(tk, sender, leader);
+	record_vote(tk, msg->sender, msg->leader);
 
 	/* only if all voted can we take the ticket now, otherwise
 	 * wait for timeout in ticket_cron */
@@ -501,17 +749,24 @@ static int process_VOTE_FOR(
 
 static int process_REJECTED(
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 		)
 {
 	uint32_t rv;
 
-	rv   = ntohl(msg->header.result);
+	rv   = msg->result;
+
+	if (msg->request == OP_PRE_VOTE || msg->request == OP_COND_VOTE) {
+		/* no vote for us; we stay as we are, see
+		 * start_pre_vote() and start_succession() */
+		tk_log_debug("%s wouldn't vote for us (%s)",
+				site_string(msg->sender),
+				state_to_string(rv));
+		return 0;
+	}
 
 	if (tk->state == ST_CANDIDATE &&
-			leader == local) {
+			msg->leader == local) {
 		/* the sender has us as the leader (!)
 		 * the elections will time out, then we can try again
 		 */
@@ -524,10 +779,10 @@ static int process_REJECTED(
 	if (tk->state == ST_CANDIDATE &&
 			rv == RLT_TERM_OUTDATED) {
 		tk_log_warn("ticket outdated (term %d), granted to %s",
-				ntohl(msg->ticket.term),
-				site_string(leader)
+				msg->term,
+				site_string(msg->leader)
 				);
-		tk->leader = leader;
+		tk->leader = msg->leader;
 		tk->expect_more_rejects = 1;
 		become_follower(tk, msg);
 		return 0;
@@ -535,21 +790,21 @@ static int process_REJECTED(
 
 	if (tk->state == ST_CANDIDATE &&
 			rv == RLT_TERM_STILL_VALID) {
-		if (tk->lost_leader == leader) {
+		if (tk->lost_leader == msg->leader) {
 			if (tk->election_reason == OR_TKT_LOST) {
 				tk_log_warn("%s still has the ticket valid, "
 						"we'll backup a bit",
-						site_string(sender));
+						site_string(msg->sender));
 			} else {
 				tk_log_warn("%s unexpectedly rejects elections",
-						site_string(sender));
+						site_string(msg->sender));
 			}
 		} else {
 			tk_log_warn("ticket was granted to %s "
 					"(and we didn't know)",
-					site_string(leader));
+					site_string(msg->leader));
 		}
-		tk->leader = leader;
+		tk->leader = msg->leader;
 		become_follower(tk, msg);
 		tk->expect_more_rejects = 1;
 		return 0;
@@ -557,15 +812,15 @@ static int process_REJECTED(
 
 	if (tk->state == ST_CANDIDATE &&
 			rv == RLT_YOU_OUTDATED) {
-		tk->leader = leader;
+		tk->leader = msg->leader;
 		tk->expect_more_rejects = 1;
-		if (leader && leader != no_leader) {
+		if (msg->leader && msg->leader != no_leader) {
 			tk_log_warn("our ticket is outdated, granted to %s",
-				site_string(leader));
+				site_string(msg->leader));
 			become_follower(tk, msg);
 		} else {
 			tk_log_warn("our ticket is outdated and revoked");
-			update_ticket_from_msg(tk, sender, msg);
+			update_ticket_from_msg(tk, msg);
 			tk->state = ST_INIT;
 		}
 		return 0;
@@ -573,7 +828,7 @@ static int process_REJECTED(
 
 	if (!tk->expect_more_rejects) {
 		tk_log_warn("from %s: in state %s, got %s (unexpected reject)",
-				site_string(sender),
+				site_string(msg->sender),
 				state_to_string(tk->state),
 				state_to_string(rv));
 	}
@@ -582,40 +837,20 @@ static int process_REJECTED(
 }
 
 
-static int ticket_seems_ok(struct ticket_config *tk)
-{
-	int time_left;
-
-	time_left = term_time_left(tk);
-	if (!time_left)
-		return 0; /* quite sure */
-	if (tk->state == ST_CANDIDATE)
-		return 0; /* in state of flux */
-	if (tk->state == ST_LEADER)
-		return 1; /* quite sure */
-	if (tk->state == ST_FOLLOWER &&
-			time_left >= tk->term_duration/3)
-		return 1; /* almost quite sure */
-	return 0;
-}
-
-
 static int test_reason(
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 		)
 {
 	int reason;
 
-	reason = ntohl(msg->header.reason);
+	reason = msg->reason;
 	if (reason == OR_TKT_LOST) {
 		if (tk->state == ST_INIT &&
 				tk->leader == no_leader) {
 			tk_log_warn("%s claims that the ticket is lost, "
 					"but it's in %s state (reject sent)",
-					site_string(sender),
+					site_string(msg->sender),
 					state_to_string(tk->state)
 				);
 			return RLT_YOU_OUTDATED;
@@ -623,7 +858,7 @@ static int test_reason(
 		if (ticket_seems_ok(tk)) {
 			tk_log_warn("%s claims that the ticket is lost, "
 					"but it is ok here (reject sent)",
-					site_string(sender));
+					site_string(msg->sender));
 			return RLT_TERM_STILL_VALID;
 		}
 	}
@@ -634,38 +869,43 @@ static int test_reason(
 /* §5.2 */
 static int answer_REQ_VOTE(
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 		)
 {
 	int valid;
 	struct boothc_ticket_msg omsg;
 	cmd_result_t inappr_reason;
 
-	inappr_reason = test_reason(tk, sender, leader, msg);
+	inappr_reason = test_reason(tk, msg);
 	if (inappr_reason)
-		return send_reject(sender, tk, inappr_reason, msg);
+		return send_reject(msg->sender, tk, inappr_reason, msg);
 
 	valid = term_time_left(tk);
 
 	/* allow the leader to start new elections on valid tickets */
-	if (sender != tk->leader && valid) {
+	if (msg->sender != tk->leader && valid) {
 		tk_log_warn("election from %s rejected "
 			"(we have %s as ticket owner), ticket still valid for %ds",
-			site_string(sender), site_string(tk->leader), valid);
-		return send_reject(sender, tk, RLT_TERM_STILL_VALID, msg);
+			site_string(msg->sender), site_string(tk->leader), valid);
+		return send_reject(msg->sender, tk, RLT_TERM_STILL_VALID, msg);
 	}
 
-	if (term_too_low(tk, sender, leader, msg))
+	if (term_too_low(tk, msg))
 		return 0;
 
+	if (promised_elsewhere(tk, msg->sender, msg->term)) {
+		tk_log_warn("election from %s rejected "
+			"(we promised the next term to %s)",
+			site_string(msg->sender), site_string(tk->successor));
+		return send_reject(msg->sender, tk, RLT_TERM_OUTDATED, msg);
+	}
+
 	/* set this, so that we know not to send status for the
 	 * ticket */
 	tk->in_election = 1;
 
 	/* if it's a newer term or ... */
-	if (newer_term(tk, sender, leader, msg, 1)) {
+	if (newer_term(tk, msg, 1)) {
 		clear_election(tk);
 		goto vote_for_sender;
 	}
@@ -675,31 +915,79 @@ static int answer_REQ_VOTE(
 	/* §5.2, §5.4 */
 	if (!tk->voted_for) {
 vote_for_sender:
-		tk->voted_for = sender;
-		record_vote(tk, sender, leader);
+		tk->voted_for = msg->sender;
+		record_vote(tk, msg->sender, msg->leader);
+	} else if (tk->state == ST_CANDIDATE && tk->voted_for == local &&
+			msg->leader == msg->sender &&
+			site_outranks(tk, msg->sender, local)) {
+		/* Two candidates in the same term would split the
+		 * votes and need another round; the one that goes first
+		 * by weight gets ours. Only we count our vote for us,
+		 * and we stop asking, so nobody wins with it twice. */
+		tk_log_info("%s goes before us, voting for it",
+				site_string(msg->sender));
+		no_resends(tk);
+		set_ticket_wakeup(tk);
+		tk->voted_for = msg->sender;
+		tk->votes_for[local->index] = msg->sender;
+		record_vote(tk, msg->sender, msg->leader);
 	}
 
 
 	init_ticket_msg(&omsg, OP_VOTE_FOR, OP_REQ_VOTE, RLT_SUCCESS, 0, tk);
 	omsg.ticket.leader = htonl(get_node_id(tk->voted_for));
-	return booth_udp_send(sender, &omsg, sizeof(omsg));
+	return booth_udp_queue(msg->sender, &omsg);
 }
 
 
-int new_election(struct ticket_config *tk,
+/* Would we vote for the sender in the term after the one in the
+ * message? Same checks as in answer_REQ_VOTE(), but nothing is
+ * changed here. */
+static int answer_PRE_VOTE(
+		struct ticket_config *tk,
+		const struct peer_msg *msg
+		)
+{
+	int valid;
+	cmd_result_t inappr_reason;
+
+	inappr_reason = test_reason(tk, msg);
+	if (inappr_reason)
+		return send_reject(msg->sender, tk, inappr_reason, msg);
+
+	valid = term_time_left(tk);
+	if (msg->sender != tk->leader && valid) {
+		tk_log_debug("no pre-vote for %s "
+			"(we have %s as ticket owner), ticket still valid for %ds",
+			site_string(msg->sender), site_string(tk->leader), valid);
+		return send_reject(msg->sender, tk, RLT_TERM_STILL_VALID, msg);
+	}
+
+	if (msg->term < tk->current_term) {
+		tk_log_debug("no pre-vote for %s, its term too low "
+			"(%d vs. %d)", site_string(msg->sender),
+			msg->term, tk->current_term);
+		return send_reject(msg->sender, tk, RLT_TERM_OUTDATED, msg);
+	}
+
+	if (promised_elsewhere(tk, msg->sender, msg->term + 1)) {
+		tk_log_debug("no pre-vote for %s, we promised "
+			"the next term to %s", site_string(msg->sender),
+			site_string(tk->successor));
+		return send_reject(msg->sender, tk, RLT_TERM_OUTDATED, msg);
+	}
+
+	return send_msg(OP_PRE_VOTE_OK, tk, msg->sender, msg);
+}
+
+
+static int start_election(struct ticket_config *tk,
 	struct booth_site *preference, int update_term, cmd_reason_t reason)
 {
 	struct booth_site *new_leader;
 	time_t now;
 
-	if (local->type != SITE)
-		return 0;
-
 	get_secs(&now);
-	tk_log_debug("start new election?, now=%" PRIi64 ", end %" PRIi64,
-			(int64_t)wall_ts(now), (int64_t)(wall_ts(tk->election_end)));
-	if (now < tk->election_end)
-		return 1;
 
 	/* §5.2 */
 	/* If there was _no_ answer, don't keep incrementing the term number
@@ -711,7 +999,10 @@ int new_election(struct ticket_config *tk,
 		/* save the previous term, we may need to send out the
 		 * MY_INDEX message */
 		if (tk->state != ST_CANDIDATE) {
-			memcpy(tk->last_valid_tk, tk, sizeof(struct ticket_config));
+			tk->last_valid.leader = tk->leader;
+			tk->last_valid.voted_for = tk->voted_for;
+			tk->last_valid.current_term = tk->current_term;
+			tk->last_valid.term_expires = tk->term_expires;
 		}
 		tk->current_term++;
 	}
@@ -719,6 +1010,7 @@ int new_election(struct ticket_config *tk,
 	tk->term_expires = 0;
 	tk->election_end = now + tk->timeout;
 	tk->in_election = 1;
+	tk->election_rounds++;
 
 	tk_log_info("starting new election (term=%d)",
 			tk->current_term);
@@ -748,6 +1040,212 @@ int new_election(struct ticket_config *tk,
 }
 
 
+/* Pre-vote (Raft thesis, §9.6): a new term sticks, and makes all the
+ * others go through the elections, too. So ask first whether a
+ * majority would vote for us at all; our term and state stay as
+ * they are until it does, see process_PRE_VOTE_OK(). Without a
+ * majority within the timeout, next_action() asks again. */
+static int start_pre_vote(struct ticket_config *tk, cmd_reason_t reason)
+{
+	struct booth_site *n;
+	int i;
+
+	if (reason == OR_AGAIN) {
+		reason = tk->election_reason;
+	} else {
+		tk->election_reason = reason;
+	}
+
+	tk_log_debug("asking for votes for term %d",
+			tk->current_term + 1);
+	ticket_broadcast(tk, OP_PRE_VOTE, OP_PRE_VOTE_OK, RLT_SUCCESS, reason);
+
+	/* Older booths don't know the question and never answer it;
+	 * count them in, else a rolling upgrade could keep us out of
+	 * the elections for good. */
+	foreach_node(i, n) {
+		if (peer_is_old(n))
+			siteset_add(tk->acks_received, n);
+	}
+	if (majority_of_sites(tk, tk->acks_received)) {
+		tk_log_debug("majority with the older sites, starting elections");
+		return start_election(tk, NULL, 1, OR_AGAIN);
+	}
+
+	ticket_next_cron_in(tk, tk->timeout);
+	add_random_delay(tk);
+	return 0;
+}
+
+
+int new_election(struct ticket_config *tk,
+	struct booth_site *preference, int update_term, cmd_reason_t reason)
+{
+	time_t now;
+
+	if (local->type != SITE)
+		return 0;
+
+	get_secs(&now);
+	tk_log_debug("start new election?, now=%" PRIi64 ", end %" PRIi64,
+			(int64_t)wall_ts(now), (int64_t)(wall_ts(tk->election_end)));
+	if (now < tk->election_end)
+		return 1;
+
+	/* a candidate already made the others vote; a tie doesn't
+	 * need to be asked about */
+	if (update_term && tk->state != ST_CANDIDATE)
+		return start_pre_vote(tk, reason);
+
+	return start_election(tk, preference, update_term, reason);
+}
+
+
+static int process_PRE_VOTE_OK(
+		struct ticket_config *tk,
+		const struct peer_msg *msg
+		)
+{
+	/* the acks are counted in update_acks() */
+	if (tk->last_request != OP_PRE_VOTE ||
+			tk->state == ST_CANDIDATE || tk->state == ST_LEADER ||
+			is_owned_elsewhere(tk) ||
+			!siteset_has(tk->acks_received, msg->sender))
+		return 0;
+
+	if (!majority_of_sites(tk, tk->acks_received))
+		return 0;
+
+	tk_log_debug("majority would vote for us, starting elections");
+	return start_election(tk, NULL, 1, OR_AGAIN);
+}
+
+
+static void promise_succession(struct ticket_config *tk,
+		struct booth_site *site)
+{
+	tk->successor = site;
+	tk->successor_term = tk->current_term + 1;
+	tk->successor_until = tk->term_expires + tk->acquire_after +
+		tk->timeout * tk->retries;
+	tk->successor_elected = 0;
+}
+
+
+/* Who takes over from a leader that is gone: the reachable site
+ * that goes first by weight. */
+static struct booth_site *preferred_successor(struct ticket_config *tk)
+{
+	struct booth_site *n, *best = NULL;
+	int i;
+
+	foreach_node(i, n) {
+		if (n->type != SITE || n == tk->leader || n->down)
+			continue;
+		if (!best || site_outranks(tk, n, best))
+			best = n;
+	}
+	return best;
+}
+
+
+/* The leader is gone, but its term still runs. If we are to take
+ * over, ask the others now to promise us their votes for the next
+ * term; with a majority, we take the ticket the moment this term is
+ * over, without elections (see successor_takes_over()). */
+void start_succession(struct ticket_config *tk)
+{
+	if (preferred_successor(tk) != local)
+		return;
+
+	tk_log_info("leader %s is gone, asking to take over "
+			"once the term expires",
+			site_string(tk->leader));
+	promise_succession(tk, local);
+	ticket_broadcast(tk, OP_COND_VOTE, OP_COND_VOTE_FOR, RLT_SUCCESS, 0);
+	ticket_activate_timeout(tk);
+}
+
+
+/* Promise our vote for the next term to the sender, if the leader is
+ * gone here, too, and we didn't promise it to somebody else. */
+static int answer_COND_VOTE(
+		struct ticket_config *tk,
+		const struct peer_msg *msg
+		)
+{
+	if (!is_owned(tk) || msg->leader != tk->leader ||
+			msg->term != tk->current_term ||
+			!term_time_left(tk)) {
+		tk_log_debug("no promise for %s, it has an outdated ticket",
+			site_string(msg->sender));
+		return send_reject(msg->sender, tk, RLT_TERM_OUTDATED, msg);
+	}
+
+	if (tk->leader == local || !tk->leader->down) {
+		tk_log_debug("no promise for %s, we still hear from %s",
+			site_string(msg->sender), site_string(tk->leader));
+		return send_reject(msg->sender, tk, RLT_TERM_STILL_VALID, msg);
+	}
+
+	if (tk->successor && tk->successor != msg->sender &&
+			tk->successor_term == tk->current_term + 1 &&
+			get_secs(NULL) < tk->successor_until) {
+		tk_log_debug("no promise for %s, we promised %s already",
+			site_string(msg->sender), site_string(tk->successor));
+		return send_reject(msg->sender, tk, RLT_BUSY, msg);
+	}
+
+	if (tk->successor != msg->sender ||
+			tk->successor_term != tk->current_term + 1) {
+		tk_log_info("promising %s our vote for term %d",
+			site_string(msg->sender), tk->current_term + 1);
+		promise_succession(tk, msg->sender);
+	}
+	return send_msg(OP_COND_VOTE_FOR, tk, msg->sender, msg);
+}
+
+
+static int process_COND_VOTE_FOR(
+		struct ticket_config *tk,
+		const struct peer_msg *msg
+		)
+{
+	/* the acks are counted in update_acks() */
+	if (tk->last_request != OP_COND_VOTE ||
+			tk->successor != local || tk->successor_elected ||
+			tk->successor_term != tk->current_term + 1 ||
+			!siteset_has(tk->acks_received, msg->sender))
+		return 0;
+
+	if (!majority_of_sites(tk, tk->acks_received))
+		return 0;
+
+	tk_log_info("majority agrees, taking over once the term expires");
+	tk->successor_elected = 1;
+	no_resends(tk);
+	set_ticket_wakeup(tk);
+	return 0;
+}
+
+
+/* The term of the lost leader is over, and a majority promised us
+ * the next one; no elections needed, and the ticket can be committed
+ * right away. */
+void successor_takes_over(struct ticket_config *tk)
+{
+	tk_log_info("taking over from %s (term=%d)",
+			site_string(tk->leader), tk->successor_term);
+	tk->current_term = tk->successor_term;
+	tk->successor = NULL;
+	tk->successor_elected = 0;
+	tk->in_election = 0;
+	tk->delay_commit = 0;
+	won_elections(tk);
+	ticket_write(tk);
+}
+
+
 /* we were a leader and somebody says that they have a more up
  * to date ticket
  * there was probably connectivity loss
@@ -755,25 +1253,23 @@ int new_election(struct ticket_config *tk,
  */
 static int leader_handle_newer_ticket(
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 	       )
 {
 	update_term_from_msg(tk, msg);
-	if (leader != no_leader && leader && leader != local) {
+	if (msg->leader != no_leader && msg->leader && msg->leader != local) {
 		/* eek, two leaders, split brain */
 		/* normally shouldn't happen; run election */
 		tk_log_error("from %s: ticket granted to %s! (revoking locally)",
-				site_string(sender),
-				site_string(leader)
+				site_string(msg->sender),
+				site_string(msg->leader)
 				);
 	} else if (term_time_left(tk)) {
 		/* eek, two leaders, split brain */
 		/* normally shouldn't happen; run election */
 		tk_log_error("from %s: ticket granted to %s! (revoking locally)",
-				site_string(sender),
-				site_string(leader)
+				site_string(msg->sender),
+				site_string(msg->leader)
 				);
 	}
 	tk->next_state = ST_LEADER;
@@ -783,27 +1279,25 @@ static int leader_handle_newer_ticket(
 /* reply to STATUS */
 static int process_MY_INDEX (
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 	       )
 {
 	int i;
 	int expired;
 
-	expired = !msg->ticket.term_valid_for;
-	i = cmp_msg_ticket(tk, sender, leader, msg);
+	expired = !msg->term_valid_for;
+	i = cmp_msg_ticket(tk, msg);
 
 	if (i > 0) {
 		/* let them know about our newer ticket */
 		/* but if we're voting in elections, our ticket is not
 		 * valid yet, don't send it */
 		if (!tk->in_election)
-			send_msg(OP_MY_INDEX, tk, sender, msg);
+			send_msg(OP_MY_INDEX, tk, msg->sender, msg);
 		if (tk->state == ST_LEADER) {
 			tk_log_info("sending ticket update to %s",
-					site_string(sender));
-			return send_msg(OP_UPDATE, tk, sender, msg);
+					site_string(msg->sender));
+			return send_msg(OP_UPDATE, tk, msg->sender, msg);
 		}
 	}
 
@@ -824,10 +1318,10 @@ static int process_MY_INDEX (
 			/* they have a newer ticket, trouble if we're already leader
 			 * for it */
 			tk_log_warn("from %s: more up to date ticket at %s",
-					site_string(sender),
-					site_string(leader)
+					site_string(msg->sender),
+					site_string(msg->leader)
 					);
-			return leader_handle_newer_ticket(tk, sender, leader, msg);
+			return leader_handle_newer_ticket(tk, msg);
 		} else {
 			/* we have the ticket and we don't care */
 			return 0;
@@ -836,96 +1330,88 @@ static int process_MY_INDEX (
 
 	/* their ticket is either newer or not expired, don't
 	 * ignore it */
-	update_ticket_from_msg(tk, sender, msg);
-	tk->leader = leader;
-	update_ticket_state(tk, sender);
+	update_ticket_from_msg(tk, msg);
+	tk->leader = msg->leader;
+	update_ticket_state(tk, msg->sender);
 	set_ticket_wakeup(tk);
 	return 0;
 }
 
 
-int raft_answer(
+/* reply to MY_INDEX */
+static int answer_STATUS (
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 	       )
 {
-	int cmd, req;
-	int rv;
+	if (tk->in_election)
+		return 0;
+	return send_msg(OP_MY_INDEX, tk, msg->sender, msg);
+}
+
 
-	rv = 0;
-	cmd = ntohl(msg->header.cmd);
-	req = ntohl(msg->header.request);
+static int (* const msg_handlers[OPX_COUNT])(struct ticket_config *tk,
+		const struct peer_msg *msg) = {
+	[OPX_STATUS]    = answer_STATUS,
+	[OPX_MY_INDEX]  = process_MY_INDEX,
+	[OPX_REQ_VOTE]  = answer_REQ_VOTE,
+	[OPX_VOTE_FOR]  = process_VOTE_FOR,
+	[OPX_HEARTBEAT] = answer_HEARTBEAT,
+	[OPX_ACK]       = process_ACK,
+	[OPX_UPDATE]    = process_UPDATE,
+	[OPX_REVOKE]    = process_REVOKE,
+	[OPX_REJECTED]  = process_REJECTED,
+	[OPX_PRE_VOTE]  = answer_PRE_VOTE,
+	[OPX_PRE_VOTE_OK] = process_PRE_VOTE_OK,
+	[OPX_HANDOVER]  = process_HANDOVER,
+	[OPX_TAKEOVER]  = process_TAKEOVER,
+	[OPX_COND_VOTE] = answer_COND_VOTE,
+	[OPX_COND_VOTE_FOR] = process_COND_VOTE_FOR,
+};
+
+
+raft_op_e raft_op(uint32_t cmd)
+{
+	switch (cmd) {
+	case OP_STATUS:    return OPX_STATUS;
+	case OP_MY_INDEX:  return OPX_MY_INDEX;
+	case OP_REQ_VOTE:  return OPX_REQ_VOTE;
+	case OP_VOTE_FOR:  return OPX_VOTE_FOR;
+	case OP_HEARTBEAT: return OPX_HEARTBEAT;
+	case OP_ACK:       return OPX_ACK;
+	case OP_UPDATE:    return OPX_UPDATE;
+	case OP_REVOKE:    return OPX_REVOKE;
+	case OP_REJECTED:  return OPX_REJECTED;
+	case OP_PRE_VOTE:  return OPX_PRE_VOTE;
+	case OP_PRE_VOTE_OK: return OPX_PRE_VOTE_OK;
+	case OP_HANDOVER:  return OPX_HANDOVER;
+	case OP_TAKEOVER:  return OPX_TAKEOVER;
+	case OP_COND_VOTE: return OPX_COND_VOTE;
+	case OP_COND_VOTE_FOR: return OPX_COND_VOTE_FOR;
+	default:           return OPX_UNKNOWN;
+	}
+}
+
+
+int raft_answer(const struct peer_msg *msg)
+{
+	struct ticket_config *tk = msg->tk;
 
-	if (req)
+	if (msg->request)
 		tk_log_debug("got %s (req %s) from %s",
-				state_to_string(cmd),
-				state_to_string(req),
-				site_string(sender));
+				state_to_string(msg->cmd),
+				state_to_string(msg->request),
+				site_string(msg->sender));
 	else
 		tk_log_debug("got %s from %s",
-				state_to_string(cmd),
-				site_string(sender));
+				state_to_string(msg->cmd),
+				site_string(msg->sender));
 
-
-	switch (cmd) {
-	case OP_REQ_VOTE:
-		rv = answer_REQ_VOTE(tk, sender, leader, msg);
-		break;
-	case OP_VOTE_FOR:
-		rv = process_VOTE_FOR(tk, sender, leader, msg);
-		break;
-	case OP_ACK:
-		if (tk->leader == local &&
-				tk->state == ST_LEADER)
-			rv = process_ACK(tk, sender, leader, msg);
-		break;
-	case OP_HEARTBEAT:
-		if ((tk->leader != local || !term_time_left(tk)) &&
-				(tk->state == ST_INIT || tk->state == ST_FOLLOWER ||
-				tk->state == ST_CANDIDATE))
-			rv = answer_HEARTBEAT(tk, sender, leader, msg);
-		else {
-			tk_log_warn("unexpected message %s, from %s",
-				state_to_string(cmd),
-				site_string(sender));
-			if (ticket_seems_ok(tk))
-				send_reject(sender, tk, RLT_TERM_STILL_VALID, msg);
-			rv = -EINVAL;
-		}
-		break;
-	case OP_UPDATE:
-		if (((tk->leader != local && tk->leader == leader) || !is_owned(tk)) &&
-				(tk->state == ST_INIT || tk->state == ST_FOLLOWER ||
-				tk->state == ST_CANDIDATE)) {
-			rv = process_UPDATE(tk, sender, leader, msg);
-		} else {
-			tk_log_warn("unexpected message %s, from %s",
-				state_to_string(cmd),
-				site_string(sender));
-			if (ticket_seems_ok(tk))
-				send_reject(sender, tk, RLT_TERM_STILL_VALID, msg);
-			rv = -EINVAL;
-		}
-		break;
-	case OP_REJECTED:
-		rv = process_REJECTED(tk, sender, leader, msg);
-		break;
-	case OP_REVOKE:
-		rv = process_REVOKE(tk, sender, leader, msg);
-		break;
-	case OP_MY_INDEX:
-		rv = process_MY_INDEX(tk, sender, leader, msg);
-		break;
-	case OP_STATUS:
-		if (!tk->in_election)
-			rv = send_msg(OP_MY_INDEX, tk, sender, msg);
-		break;
-	default:
+	if (msg->op == OPX_UNKNOWN) {
 		tk_log_error("unknown message %s, from %s",
-			state_to_string(cmd), site_string(sender));
-		rv = -EINVAL;
+			state_to_string(msg->cmd), site_string(msg->sender));
+		return -EINVAL;
 	}
-	return rv;
+
+	return msg_handlers[msg->op](tk, msg);
 }
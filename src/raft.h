@@ -30,14 +30,53 @@ typedef enum {
 
 struct ticket_config;
 
-int raft_answer(struct ticket_config *tk,
-		struct booth_site *from,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg);
+/** Compact opcodes, used to index the handler table in raft_answer(). */
+typedef enum {
+	OPX_UNKNOWN = 0,
+	OPX_STATUS,
+	OPX_MY_INDEX,
+	OPX_REQ_VOTE,
+	OPX_VOTE_FOR,
+	OPX_HEARTBEAT,
+	OPX_ACK,
+	OPX_UPDATE,
+	OPX_REVOKE,
+	OPX_REJECTED,
+	OPX_PRE_VOTE,
+	OPX_PRE_VOTE_OK,
+	OPX_HANDOVER,
+	OPX_TAKEOVER,
+	OPX_COND_VOTE,
+	OPX_COND_VOTE_FOR,
+	OPX_COUNT,
+} raft_op_e;
+
+/** A peer message, checked and converted to host order once on
+ * receipt (see message_recv_tk()), with sender, leader and ticket
+ * already resolved. */
+struct peer_msg {
+	raft_op_e op;
+	uint32_t cmd;
+	uint32_t request;
+	uint32_t options;
+	uint32_t result;
+	uint32_t reason;
+	uint32_t term;
+	uint32_t term_valid_for;
+	struct booth_site *sender;
+	struct booth_site *leader;
+	struct ticket_config *tk;
+};
+
+raft_op_e raft_op(uint32_t cmd);
+int raft_answer(const struct peer_msg *msg);
 
 int new_election(struct ticket_config *tk,
 		struct booth_site *new_leader, int update_term, cmd_reason_t reason);
 void elections_end(struct ticket_config *tk);
+void start_succession(struct ticket_config *tk);
+void successor_takes_over(struct ticket_config *tk);
+void raft_ticket_written(struct ticket_config *tk, int rv);
 
 
 #endif /* _RAFT_H */
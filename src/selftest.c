@@ -0,0 +1,748 @@
+/* 
+ * Copyright (C) 2014 Philipp Marek <philipp.marek@linbit.com>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "booth.h"
+#include "config.h"
+#include "ticket.h"
+#include "raft.h"
+#include "handler.h"
+#include "transport.h"
+#include "inline-fn.h"
+
+
+/** \file
+ * Self-checks and microbenchmarks of some boothd internals.
+ *
+ * Without arguments all checks are run ("make check"); the exit status
+ * tells whether they passed. "selftest bench-lookup [count]" prints
+ * the time per ticket lookup, "selftest bench-recv [count]" the time
+ * per received peer message.
+ *
+ * The transport checks use real UDP sockets on 127.0.0.1 and
+ * 127.0.0.2, with a port other than booth's default, so that a running
+ * booth doesn't get in the way.
+ *
+ * This is linked with the objects of boothd, whose main() is renamed
+ * by the Makefile.
+ */
+#undef main
+
+
+static int failures;
+
+#define CHECK(cond)	do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+				__FILE__, __LINE__, #cond);		\
+		failures++;						\
+	}								\
+} while (0)
+
+
+/** Configure three sites and the named tickets; @names is
+ * NULL-terminated, or NULL to get @count tickets "<prefix><n>". */
+static int load_config(const char **names, int count, const char *prefix)
+{
+	char path[] = "/tmp/booth-selftest.XXXXXX";
+	FILE *fp;
+	int fd, i, rv;
+
+	fd = mkstemp(path);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		perror("can't create a config file");
+		exit(2);
+	}
+
+	fprintf(fp, "port = 29929\n"
+			"site = 127.0.0.1\n"
+			"site = 127.0.0.2\n"
+			"site = 127.0.0.3\n");
+	if (names) {
+		for (i = 0; names[i]; i++)
+			fprintf(fp, "ticket = \"%s\"\n", names[i]);
+	} else {
+		for (i = 0; i < count; i++)
+			fprintf(fp, "ticket = \"%s%d\"\n", prefix, i);
+	}
+	fclose(fp);
+
+	rv = read_config(path, SITE);
+	unlink(path);
+	if (rv < 0) {
+		fprintf(stderr, "can't read the generated config\n");
+		exit(2);
+	}
+
+	local = booth_conf->site;
+	return 0;
+}
+
+
+static long ns_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L +
+		(now.tv_nsec - start->tv_nsec);
+}
+
+
+/** \name Ticket name index, see ticket_hash_find().
+ * @{ */
+
+/* The same as ticket_name_hash() in config.c. */
+static uint32_t name_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static void check_lookup_misses(void)
+{
+	const char *misses[] = { "", "t", "t-1", "T1", "t1x", "t100000", NULL };
+	struct ticket_config *tk;
+	int i;
+
+	for (i = 0; misses[i]; i++) {
+		CHECK(ticket_hash_find(misses[i]) == -1);
+		tk = booth_conf->ticket;
+		CHECK(!find_ticket_by_name(misses[i], &tk) && !tk);
+	}
+}
+
+
+/* Enough tickets to grow the index a few times. */
+static void check_lookup(void)
+{
+	struct ticket_config *tk, *found;
+	int i;
+
+	load_config(NULL, 5000, "t");
+	CHECK(booth_conf->ticket_count == 5000);
+	CHECK(booth_conf->ticket_hash_size >= 2 * 5000);
+
+	foreach_ticket(i, tk) {
+		CHECK(ticket_hash_find(tk->name) == i);
+		CHECK(find_ticket_by_name(tk->name, &found) && found == tk);
+	}
+
+	check_lookup_misses();
+}
+
+
+/* Names that all want the last slot of the smallest index, so that
+ * probing has to wrap around; and a miss that wants it, too. */
+static void check_lookup_collisions(void)
+{
+	static char buf[9][16];
+	const char *names[9];
+	int i, n;
+
+	n = 0;
+	for (i = 0; n < 9; i++) {
+		sprintf(buf[n], "c%d", i);
+		if ((name_hash(buf[n]) & 63) == 63)
+			n++;
+	}
+
+	for (i = 0; i < 8; i++)
+		names[i] = buf[i];
+	names[8] = NULL;
+	load_config(names, 0, NULL);
+	CHECK(booth_conf->ticket_hash_size == 64);
+
+	for (i = 0; i < 8; i++)
+		CHECK(ticket_hash_find(names[i]) == i);
+	CHECK(ticket_hash_find(buf[8]) == -1);
+
+	check_lookup_misses();
+}
+
+
+/* How find_ticket_by_name() used to do it. */
+static int linear_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < booth_conf->ticket_count; i++)
+		if (!strcmp(booth_conf->ticket[i].name, name))
+			return i;
+	return -1;
+}
+
+
+static void bench_lookup(long n)
+{
+	static const int counts[] = { 10, 100, 1000, 10000 };
+	struct ticket_config *tk;
+	struct timespec start;
+	volatile long sink = 0;
+	long i, m, hashed, linear;
+	int c, count;
+
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		count = counts[c];
+		load_config(NULL, count, "bench");
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < n; i++) {
+			find_ticket_by_name(booth_conf->ticket[i % count].name,
+					&tk);
+			sink += (long)tk;
+		}
+		hashed = ns_since(&start);
+
+		/* Don't wait for ages with many tickets. */
+		m = min(n, 100000000L / count);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < m; i++)
+			sink += linear_find(booth_conf->ticket[i % count].name);
+		linear = ns_since(&start);
+
+		printf("%6d tickets: %7.1f ns/lookup, linear search %9.1f\n",
+				count, (double)hashed / n, (double)linear / m);
+	}
+}
+/** @} */
+
+
+/* message_recv() for messages that change nothing: acks, votes and
+ * rejects that a follower ignores. That's mostly decoding the message,
+ * and finding the sender and the ticket; see struct peer_msg. */
+static void bench_recv(long n)
+{
+	static const int cmds[] = { OP_ACK, OP_VOTE_FOR, OP_REJECTED };
+	struct boothc_ticket_msg msgs[3];
+	struct ticket_config *tk;
+	struct booth_site *leader;
+	struct timespec start;
+	long i;
+	int k;
+
+	load_config(NULL, 50, "bench");
+	leader = booth_conf->site + 1;
+	tk = booth_conf->ticket + 20;
+	tk->state = ST_FOLLOWER;
+	tk->leader = leader;
+	tk->current_term = 5;
+	tk->expect_more_rejects = 1;
+
+	for (k = 0; k < 3; k++) {
+		memset(msgs + k, 0, sizeof(msgs[k]));
+		init_header(&msgs[k].header, cmds[k], 0, 0,
+				RLT_TERM_STILL_VALID, 0, sizeof(msgs[k]));
+		msgs[k].header.from = htonl(leader->site_id);
+		strcpy(msgs[k].ticket.id, tk->name);
+		msgs[k].ticket.leader = htonl(leader->site_id);
+		msgs[k].ticket.term = htonl(5);
+		msgs[k].ticket.term_valid_for = htonl(60);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++)
+		message_recv(msgs + i % 3, sizeof(msgs[0]));
+	printf("%.1f ns/message\n", (double)ns_since(&start) / n);
+}
+
+
+/** \name Multi-record packets, see booth_udp_queue() and
+ * deliver_datagram(). The selftest plays site[1] here.
+ * @{ */
+
+static int peer_fd = -1;
+/** Plays site[2], which never says anything */
+static int quiet_fd = -1;
+/** Index in clients[] of boothd's UDP socket */
+static int udp_ci;
+
+/** What boothd passed on for the ticket code */
+static struct boothc_ticket_msg delivered[4];
+static int delivered_count;
+
+#define MULTI_RECS_MAX \
+	((BOOTH_UDP_MAX_LEN - sizeof(struct boothc_header)) / \
+	 sizeof(struct boothc_multi_rec))
+
+
+static int deliver(void *buf, int len)
+{
+	if (len == sizeof(delivered[0]) && delivered_count < 4)
+		memcpy(delivered + delivered_count, buf, len);
+	delivered_count++;
+	return 0;
+}
+
+
+static void peer_header(struct boothc_header *h, int version, int cmd,
+		uint32_t request, int options, int len)
+{
+	init_header(h, cmd, request, options, 0, 0, len);
+	h->version = htonl(version);
+	h->from = htonl(booth_conf->site[1].site_id);
+}
+
+
+/* From the peer to boothd, which processes it right away. */
+static void peer_send(void *buf, int len)
+{
+	delivered_count = 0;
+	if (sendto(peer_fd, buf, len, 0, (struct sockaddr *)&local->sa6,
+				local->saddrlen) != len) {
+		perror("can't send to boothd");
+		exit(2);
+	}
+	clients[udp_ci].workfn(udp_ci);
+}
+
+
+/* What boothd sent to the peer; the length, or -1 for nothing. */
+static int peer_recv(void *buf)
+{
+	return recv(peer_fd, buf, BOOTH_UDP_MAX_LEN + 1, MSG_DONTWAIT);
+}
+
+
+/* Let boothd know what the peer understands. */
+static void peer_announce(int multi, uint32_t list_hash)
+{
+	struct boothc_ticket_msg msg;
+
+	if (multi) {
+		/* a probe answer */
+		peer_header(&msg.header, BOOTHC_VERSION_MULTI, OP_PONG,
+				list_hash, OPT_MULTI_RECORD,
+				sizeof(msg.header));
+		peer_send(&msg, sizeof(msg.header));
+	} else {
+		memset(&msg, 0, sizeof(msg));
+		peer_header(&msg.header, BOOTHC_VERSION, OP_STATUS, 0, 0,
+				sizeof(msg));
+		strcpy(msg.ticket.id, booth_conf->ticket[0].name);
+		peer_send(&msg, sizeof(msg));
+	}
+}
+
+
+static void queue_heartbeats(int count)
+{
+	struct boothc_ticket_msg msg;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		init_ticket_msg(&msg, OP_HEARTBEAT, 0, RLT_SUCCESS, 0,
+				booth_conf->ticket + i % booth_conf->ticket_count);
+		booth_udp_queue(booth_conf->site + 1, &msg);
+	}
+	booth_udp_flush();
+}
+
+
+static void transport_setup(void)
+{
+	struct booth_site *peer;
+
+	load_config(NULL, 4, "t");
+	if (booth_transport[UDP].init(deliver) < 0) {
+		fprintf(stderr, "can't set up boothd's UDP socket\n");
+		exit(2);
+	}
+	for (udp_ci = 0; clients[udp_ci].fd != local->udp_fd; udp_ci++)
+		;
+
+	peer = booth_conf->site + 1;
+	peer_fd = socket(peer->family, SOCK_DGRAM, 0);
+	if (peer_fd < 0 ||
+			bind(peer_fd, (struct sockaddr *)&peer->sa6,
+				peer->saddrlen) < 0) {
+		perror("can't bind the peer's UDP socket");
+		exit(2);
+	}
+
+	peer = booth_conf->site + 2;
+	quiet_fd = socket(peer->family, SOCK_DGRAM, 0);
+	if (quiet_fd < 0 ||
+			bind(quiet_fd, (struct sockaddr *)&peer->sa6,
+				peer->saddrlen) < 0) {
+		perror("can't bind the quiet peer's UDP socket");
+		exit(2);
+	}
+}
+
+
+static void check_multi_pack(void)
+{
+	char buf[BOOTH_UDP_MAX_LEN + 1];
+	struct boothc_header *h = (void *)buf;
+	struct boothc_multi_id_rec *id_rec = (void *)h->data;
+	struct boothc_multi_rec *rec = (void *)h->data;
+	struct boothc_ticket_msg *msg = (void *)buf;
+	uint32_t list_hash = booth_conf->ticket_list_hash;
+	int i;
+
+	/* same tickets: by index */
+	peer_announce(1, list_hash);
+	queue_heartbeats(3);
+	CHECK(peer_recv(buf) == sizeof(*h) + 3 * sizeof(*id_rec));
+	CHECK(h->version == htonl(BOOTHC_VERSION_MULTI));
+	CHECK(ntohl(h->options) & OPT_TICKET_IDS);
+	CHECK(ntohl(h->request) == list_hash);
+	for (i = 0; i < 3; i++) {
+		CHECK(ntohl(id_rec[i].cmd) == OP_HEARTBEAT);
+		CHECK(ntohl(id_rec[i].ticket) == i);
+	}
+	CHECK(peer_recv(buf) == -1);
+
+	/* other tickets: by name */
+	peer_announce(1, list_hash + 1);
+	queue_heartbeats(3);
+	CHECK(peer_recv(buf) == sizeof(*h) + 3 * sizeof(*rec));
+	CHECK(!(ntohl(h->options) & OPT_TICKET_IDS));
+	for (i = 0; i < 3; i++) {
+		CHECK(ntohl(rec[i].cmd) == OP_HEARTBEAT);
+		CHECK(!strcmp(rec[i].ticket.id, booth_conf->ticket[i].name));
+	}
+	CHECK(peer_recv(buf) == -1);
+
+	/* more than fit into one packet */
+	queue_heartbeats(MULTI_RECS_MAX + 1);
+	CHECK(peer_recv(buf) == sizeof(*h) + MULTI_RECS_MAX * sizeof(*rec));
+	CHECK(peer_recv(buf) == sizeof(*h) + sizeof(*rec));
+	CHECK(ntohl(h->length) == sizeof(*h) + sizeof(*rec));
+	CHECK(peer_recv(buf) == -1);
+
+	/* an older peer gets one message per packet */
+	peer_announce(0, 0);
+	queue_heartbeats(2);
+	for (i = 0; i < 2; i++) {
+		CHECK(peer_recv(buf) == sizeof(*msg));
+		CHECK(h->version == htonl(BOOTHC_VERSION));
+		CHECK(ntohl(h->options) & OPT_MULTI_RECORD);
+		CHECK(!strcmp(msg->ticket.id, booth_conf->ticket[i].name));
+	}
+	CHECK(peer_recv(buf) == -1);
+}
+
+
+static void check_multi_recv(void)
+{
+	char buf[BOOTH_UDP_MAX_LEN + 32];
+	struct boothc_header *h = (void *)buf;
+	struct boothc_multi_id_rec *id_rec = (void *)h->data;
+	struct boothc_multi_rec *rec = (void *)h->data;
+	struct boothc_ticket_msg *msg = (void *)buf, *got;
+	uint32_t list_hash = booth_conf->ticket_list_hash;
+	int i, len;
+
+	/* by name */
+	len = sizeof(*h) + 3 * sizeof(*rec);
+	memset(buf, 0, sizeof(buf));
+	peer_header(h, BOOTHC_VERSION_MULTI, 0, list_hash, 0, len);
+	for (i = 0; i < 3; i++) {
+		rec[i].cmd = htonl(OP_HEARTBEAT);
+		rec[i].ticket.term = htonl(i + 10);
+		strcpy(rec[i].ticket.id, booth_conf->ticket[i].name);
+	}
+	peer_send(buf, len);
+	CHECK(delivered_count == 3);
+	for (i = 0; i < 3; i++) {
+		got = delivered + i;
+		CHECK(got->header.version == htonl(BOOTHC_VERSION));
+		CHECK(got->header.length == htonl(sizeof(*got)));
+		CHECK(got->header.from == h->from);
+		CHECK(got->header.cmd == htonl(OP_HEARTBEAT));
+		CHECK(got->ticket.term == htonl(i + 10));
+		CHECK(!strcmp(got->ticket.id, booth_conf->ticket[i].name));
+	}
+
+	/* truncated */
+	peer_send(buf, len - 10);
+	CHECK(delivered_count == 0);
+
+	/* oversized */
+	peer_send(buf, len + 10);
+	CHECK(delivered_count == 0);
+
+	/* not a whole number of records, even if the length says so */
+	h->length = htonl(len - 10);
+	peer_send(buf, len - 10);
+	CHECK(delivered_count == 0);
+
+	/* no record at all */
+	h->length = htonl(sizeof(*h));
+	peer_send(buf, sizeof(*h));
+	CHECK(delivered_count == 0);
+
+	/* by index; these go to the ticket code directly, and a status
+	 * request gets answered */
+	peer_announce(1, list_hash);
+	len = sizeof(*h) + sizeof(*id_rec);
+	memset(buf, 0, sizeof(buf));
+	peer_header(h, BOOTHC_VERSION_MULTI, 0, list_hash,
+			OPT_TICKET_IDS, len);
+	id_rec->cmd = htonl(OP_STATUS);
+	id_rec->ticket = htonl(1);
+	id_rec->leader = htonl(NO_ONE);
+	peer_send(buf, len);
+	booth_udp_flush();
+	CHECK(peer_recv(buf) == sizeof(*msg));
+	CHECK(ntohl(msg->header.cmd) == OP_MY_INDEX);
+	CHECK(!strcmp(msg->ticket.id, booth_conf->ticket[1].name));
+
+	/* ... but not if the sender has other tickets */
+	peer_header(h, BOOTHC_VERSION_MULTI, 0, list_hash + 1,
+			OPT_TICKET_IDS, len);
+	id_rec->cmd = htonl(OP_STATUS);
+	id_rec->ticket = htonl(1);
+	id_rec->leader = htonl(NO_ONE);
+	peer_send(buf, len);
+	booth_udp_flush();
+	CHECK(peer_recv(buf) == -1);
+
+	/* nor for a ticket index we don't have */
+	peer_announce(1, list_hash);
+	peer_header(h, BOOTHC_VERSION_MULTI, 0, list_hash,
+			OPT_TICKET_IDS, len);
+	id_rec->cmd = htonl(OP_STATUS);
+	id_rec->ticket = htonl(booth_conf->ticket_count);
+	id_rec->leader = htonl(NO_ONE);
+	peer_send(buf, len);
+	booth_udp_flush();
+	CHECK(peer_recv(buf) == -1);
+}
+/** @} */
+
+
+/** \name Peer liveness, see process_peer_timeouts() and
+ * peers_answer_list().
+ * @{ */
+
+/* What 'booth peers' would print. */
+static void peers_list(char *buf, int size)
+{
+	struct client *c;
+	int sv[2], ci, len;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ||
+			(ci = client_add(sv[0], booth_transport + TCP,
+					 NULL, NULL)) < 0) {
+		perror("can't set up a client");
+		exit(2);
+	}
+	c = clients + ci;
+	CHECK(peers_answer_list(ci, NULL) == 0);
+
+	len = c->out_len - sizeof(struct boothc_header);
+	if (len < 0)
+		len = 0;
+	if (len >= size)
+		len = size - 1;
+	memcpy(buf, c->out + c->out_len - len, len);
+	buf[len] = '\0';
+
+	client_dead(ci);
+	close(sv[1]);
+}
+
+
+static void check_peer_probes(void)
+{
+	struct booth_site *peer = booth_conf->site + 1;
+	char buf[BOOTH_UDP_MAX_LEN + 1];
+	struct boothc_header *h = (void *)buf;
+	uint32_t list_hash = booth_conf->ticket_list_hash;
+	char list[1024];
+
+	/* quiet for a while: probed */
+	peer_announce(1, list_hash);
+	while (peer_recv(buf) >= 0)
+		;
+	peer->last_recv -= PEER_PROBE_INTERVAL;
+	process_peer_timeouts();
+	CHECK(peer_recv(buf) == sizeof(*h));
+	CHECK(h->version == htonl(BOOTHC_VERSION_MULTI));
+	CHECK(ntohl(h->cmd) == OP_PING);
+	CHECK(ntohl(h->request) == list_hash);
+	CHECK(!peer->down);
+
+	/* the answer gives a round trip time */
+	peer_header(h, BOOTHC_VERSION_MULTI, OP_PONG, list_hash,
+			OPT_MULTI_RECORD, sizeof(*h));
+	peer_send(buf, sizeof(*h));
+	CHECK(peer->srtt[RTT_PLAIN] > 0);
+	peers_list(list, sizeof(list));
+	CHECK(strstr(list, "site: 127.0.0.2, type: site, "
+				"state: up, last heard 0s ago, rtt "));
+
+	/* probed, but silent for too long: down */
+	peer->last_recv -= PEER_DOWN_AFTER;
+	peer->last_probe = peer->last_recv + 1;
+	process_peer_timeouts();
+	CHECK(peer->down);
+	peers_list(list, sizeof(list));
+	CHECK(strstr(list, "site: 127.0.0.2, type: site, "
+				"state: down, last heard 6s ago"));
+
+	/* its probe gets answered, and it's up again */
+	while (peer_recv(buf) >= 0)
+		;
+	peer_header(h, BOOTHC_VERSION_MULTI, OP_PING, list_hash,
+			OPT_MULTI_RECORD, sizeof(*h));
+	peer_send(buf, sizeof(*h));
+	CHECK(!peer->down);
+	CHECK(peer_recv(buf) == sizeof(*h));
+	CHECK(ntohl(h->cmd) == OP_PONG);
+	peers_list(list, sizeof(list));
+	CHECK(strstr(list, "site: 127.0.0.2, type: site, "
+				"state: up, last heard 0s ago"));
+
+	/* an older booth doesn't answer probes; it's never taken as down */
+	peer_announce(0, 0);
+	peer->last_recv -= PEER_DOWN_AFTER;
+	process_peer_timeouts();
+	CHECK(!peer->down);
+	CHECK(peer_recv(buf) == -1);
+}
+
+/* A peer that never said anything may be an older booth, which would
+ * log every probe; it gets a few only, until it talks to us. */
+static void check_probes_unseen(void)
+{
+	struct booth_site *quiet = booth_conf->site + 2;
+	char buf[BOOTH_UDP_MAX_LEN + 1];
+	struct boothc_header *h = (void *)buf;
+	int i, probes = 0;
+
+	quiet->last_recv -= PEER_DOWN_AFTER;
+	for (i = 0; i < PEER_PROBES_UNSEEN + 3; i++) {
+		quiet->last_probe -= PEER_PROBE_INTERVAL;
+		process_peer_timeouts();
+	}
+	while (recv(quiet_fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0)
+		probes++;
+	CHECK(probes == PEER_PROBES_UNSEEN);
+	CHECK(quiet->down);
+
+	/* it talks to us: up, and probed again */
+	init_header(h, OP_PONG, booth_conf->ticket_list_hash,
+			OPT_MULTI_RECORD, 0, 0, sizeof(*h));
+	h->version = htonl(BOOTHC_VERSION_MULTI);
+	h->from = htonl(quiet->site_id);
+	if (sendto(quiet_fd, buf, sizeof(*h), 0,
+				(struct sockaddr *)&local->sa6,
+				local->saddrlen) != sizeof(*h)) {
+		perror("can't send to boothd");
+		exit(2);
+	}
+	clients[udp_ci].workfn(udp_ci);
+	CHECK(!quiet->down);
+
+	quiet->last_recv -= PEER_PROBE_INTERVAL;
+	quiet->last_probe -= PEER_PROBE_INTERVAL;
+	process_peer_timeouts();
+	CHECK(recv(quiet_fd, buf, sizeof(buf), MSG_DONTWAIT) == sizeof(*h));
+	CHECK(ntohl(h->cmd) == OP_PING);
+}
+
+
+/* An older booth never answers a pre-vote; counted in, it makes a
+ * majority with us right away, see start_pre_vote(). */
+static void check_pre_vote_old_peer(void)
+{
+	struct ticket_config *tk = booth_conf->ticket + 2;
+	char buf[BOOTH_UDP_MAX_LEN + 1];
+	int term = tk->current_term;
+
+	peer_announce(0, 0);
+	tk->state = ST_FOLLOWER;
+	new_election(tk, NULL, 1, OR_ADMIN);
+	CHECK(tk->state == ST_CANDIDATE);
+	CHECK(tk->last_request == OP_REQ_VOTE);
+	CHECK(tk->current_term == term + 1);
+
+	booth_udp_flush();
+	while (peer_recv(buf) >= 0)
+		;
+}
+/** @} */
+
+
+/* A second grant while the before-acquire-handler runs for the first
+ * one must leave the first one's commit delay alone. */
+static void check_grant_busy(void)
+{
+	struct ticket_config *tk = booth_conf->ticket + 3;
+
+	tk->verify_for = VERIFY_ACQUIRE;
+	tk->delay_commit = get_secs(NULL) + 1000;
+	CHECK(do_grant_ticket(tk, OPT_IMMEDIATE) == RLT_BUSY);
+	CHECK(tk->delay_commit > get_secs(NULL));
+	tk->verify_for = 0;
+	tk->delay_commit = 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	long n = argc > 2 ? atol(argv[2]) : 10000000;
+
+	if (argc > 1) {
+		if (!strcmp(argv[1], "bench-lookup")) {
+			bench_lookup(n);
+			return 0;
+		}
+		if (!strcmp(argv[1], "bench-recv")) {
+			bench_recv(n);
+			return 0;
+		}
+		fprintf(stderr, "usage: %s "
+				"[bench-lookup|bench-recv [count]]\n", argv[0]);
+		return 2;
+	}
+
+	check_lookup();
+	check_lookup_collisions();
+
+	transport_setup();
+	check_multi_pack();
+	check_multi_recv();
+	check_peer_probes();
+	check_probes_unseen();
+	check_pre_vote_old_peer();
+	check_grant_busy();
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,93 @@
+/* 
+ * Copyright (C) 2014 Philipp Marek <philipp.marek@linbit.com>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SITESET_H
+#define _SITESET_H
+
+#include <stdint.h>
+#include <string.h>
+#include "booth.h"
+#include "config.h"
+
+/** \file
+ * Sets of sites, as bitmaps indexed by booth_site.index.
+ *
+ * All sets have booth_conf->siteset_words words, which is enough for
+ * all configured sites; see setup_sitesets(). Usually that's just one
+ * word, so the loops are short. */
+
+
+static inline int siteset_bytes(void)
+{
+	return booth_conf->siteset_words * sizeof(siteset_word_t);
+}
+
+static inline void siteset_clear(siteset_word_t *set)
+{
+	memset(set, 0, siteset_bytes());
+}
+
+static inline void siteset_add(siteset_word_t *set, const struct booth_site *site)
+{
+	set[site->index / SITESET_WORD_BITS] |=
+		(siteset_word_t)1 << (site->index % SITESET_WORD_BITS);
+}
+
+static inline int siteset_has(const siteset_word_t *set,
+		const struct booth_site *site)
+{
+	return (set[site->index / SITESET_WORD_BITS] >>
+			(site->index % SITESET_WORD_BITS)) & 1;
+}
+
+/** Make the set contain only this site. */
+static inline void siteset_only(siteset_word_t *set, const struct booth_site *site)
+{
+	siteset_clear(set);
+	siteset_add(set, site);
+}
+
+static inline int siteset_count(const siteset_word_t *set)
+{
+	int i, n = 0;
+
+	for (i = 0; i < booth_conf->siteset_words; i++)
+		n += __builtin_popcountll(set[i]);
+	return n;
+}
+
+/** Whether all sites in sub are in set, too. */
+static inline int siteset_includes(const siteset_word_t *set,
+		const siteset_word_t *sub)
+{
+	siteset_word_t missing = 0;
+	int i;
+
+	for (i = 0; i < booth_conf->siteset_words; i++)
+		missing |= sub[i] & ~set[i];
+	return !missing;
+}
+
+/** Whether the set contains this site, and no other. */
+static inline int siteset_is_only(const siteset_word_t *set,
+		const struct booth_site *site)
+{
+	return siteset_has(set, site) && siteset_count(set) == 1;
+}
+
+#endif
@@ -0,0 +1,195 @@
+/* 
+ * Copyright (C) 2014 Philipp Marek <philipp.marek@linbit.com>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "booth.h"
+#include "config.h"
+#include "inline-fn.h"
+#include "log.h"
+#include "store.h"
+
+
+/** \file
+ * Ticket handler that keeps the ticket state in a local directory,
+ * one file per ticket; configured via
+ *	ticket-handler = file
+ *	ticket-handler-path = <directory>
+ *
+ * Mostly useful for testing without Pacemaker and for benchmarks;
+ * the files are written without fsync().
+ *
+ * Each file has a single line
+ *	<granted> <owner> <expires> <term>
+ * where owner is the site id (-1 for no owner) and expires is a
+ * wall-clock timestamp.
+ */
+
+
+static int file_path(struct ticket_config *tk, char *buf, int len,
+		const char *prefix)
+{
+	int rv;
+
+	if (strchr(tk->name, '/')) {
+		tk_log_error("ticket name unusable as a file name");
+		return -EINVAL;
+	}
+
+	rv = snprintf(buf, len, "%s/%s%s",
+			booth_conf->ticket_handler_path, prefix, tk->name);
+	if (rv >= len) {
+		tk_log_error("file name too long");
+		return -ENAMETOOLONG;
+	}
+	return 0;
+}
+
+
+static int file_write_ticket(struct ticket_config *tk)
+{
+	char path[BOOTH_PATH_LEN + BOOTH_NAME_LEN + 4];
+	char tmp[BOOTH_PATH_LEN + BOOTH_NAME_LEN + 4];
+	FILE *fp;
+	int rv;
+
+	rv = file_path(tk, path, sizeof(path), "");
+	if (rv < 0)
+		return rv;
+	rv = file_path(tk, tmp, sizeof(tmp), ".");
+	if (rv < 0)
+		return rv;
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		rv = -errno;
+		tk_log_error("cannot write \"%s\": %s", tmp, strerror(errno));
+		return rv;
+	}
+
+	fprintf(fp, "%d %" PRIi32 " %" PRIi64 " %" PRIu32 "\n",
+			tk->cib_leader == local,
+			(int32_t)get_node_id(tk->cib_leader),
+			(int64_t)wall_ts(tk->cib_expires),
+			tk->cib_term);
+
+	if (fclose(fp) == EOF) {
+		rv = -errno;
+		tk_log_error("cannot write \"%s\": %s", tmp, strerror(errno));
+		unlink(tmp);
+		return rv;
+	}
+
+	/* So that there's never a partial file. */
+	if (rename(tmp, path) < 0) {
+		rv = -errno;
+		tk_log_error("cannot rename \"%s\": %s", tmp, strerror(errno));
+		unlink(tmp);
+		return rv;
+	}
+
+	return 0;
+}
+
+
+/* Local files are fast enough to be written right away. */
+static int file_submit(struct ticket_config **tks, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		store_write_done(tks[i], file_write_ticket(tks[i]));
+
+	return 0;
+}
+
+
+static int file_load_ticket(struct ticket_config *tk)
+{
+	char path[BOOTH_PATH_LEN + BOOTH_NAME_LEN + 4];
+	FILE *fp;
+	int rv, granted;
+	int32_t owner;
+	int64_t expires;
+	uint32_t term;
+
+	rv = file_path(tk, path, sizeof(path), "");
+	if (rv < 0)
+		return rv;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		/* No state stored yet. */
+		if (errno == ENOENT)
+			return ENOENT;
+
+		rv = errno;
+		tk_log_error("cannot read \"%s\": %s", path, strerror(errno));
+		return rv;
+	}
+
+	rv = fscanf(fp, "%d %" SCNi32 " %" SCNi64 " %" SCNu32,
+			&granted, &owner, &expires, &term);
+	fclose(fp);
+	if (rv != 4) {
+		tk_log_error("cannot parse \"%s\"", path);
+		return EINVAL;
+	}
+
+	tk->term_expires = unwall_ts(expires);
+	tk->current_term = term;
+	tk->is_granted = granted;
+	store_loaded_owner(tk, owner);
+
+	return 0;
+}
+
+
+static int file_init(void)
+{
+	const char *dir = booth_conf->ticket_handler_path;
+	int rv;
+
+	if (!*dir) {
+		log_error("the file ticket handler needs a directory "
+				"in ticket-handler-path");
+		return -EINVAL;
+	}
+
+	if (access(dir, R_OK | W_OK | X_OK) < 0) {
+		rv = -errno;
+		log_error("cannot use \"%s\" for storing tickets: %s",
+				dir, strerror(errno));
+		return rv;
+	}
+
+	return 0;
+}
+
+
+struct ticket_handler file_handler = {
+	.name           = "file",
+	.init           = file_init,
+	.load_ticket    = file_load_ticket,
+	.submit         = file_submit,
+};
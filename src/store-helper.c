@@ -0,0 +1,450 @@
+/* 
+ * Copyright (C) 2014 Philipp Marek <philipp.marek@linbit.com>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "booth.h"
+#include "config.h"
+#include "inline-fn.h"
+#include "pacemaker.h"
+#include "log.h"
+#include "store.h"
+
+
+/** \file
+ * Ticket handler that talks to a long-running helper process;
+ * configured via
+ *	ticket-handler = helper
+ *	ticket-handler-path = <command>
+ *
+ * The helper can keep its CIB connection open, so that a ticket
+ * update costs a few writes on a pipe instead of starting crm_ticket.
+ *
+ * The command gets requests on stdin, one per line:
+ *	grant <ticket> <owner> <expires> <term>
+ *	revoke <ticket> <owner> <expires> <term>
+ *	load <ticket>
+ * and has to answer each of them, in order, with a line on stdout:
+ *	ok
+ *	ok <granted> <owner> <expires> <term>	(for "load")
+ *	none					(for "load", no state)
+ *	error <message>
+ * owner is the site id (-1 for no owner), expires a wall-clock
+ * timestamp, granted is 0 or 1.
+ *
+ * If the helper goes away, the outstanding updates fail (and are
+ * retried later on); the helper is started again with the next one.
+ */
+
+
+#define HELPER_LINE_MAX		512
+/** How long a load request may wait for room in the helper's stdin. */
+#define HELPER_WRITE_TIMEOUT_MS	5000
+
+
+static pid_t helper_pid;
+/** Its stdin, non-blocking. */
+static int helper_in = -1;
+/** Its stdout, as index into clients[]. */
+static int helper_ci = -1;
+
+/** Requests not written to the helper yet. */
+static char *outbuf;
+static int out_len;
+
+/** Partial answer. */
+static char inbuf[HELPER_LINE_MAX];
+static int in_len;
+
+/** Tickets waiting for an answer, in order; a ring buffer.
+ * Each ticket has at most one update outstanding. */
+static struct ticket_config **pending;
+static int pending_head, pending_len;
+
+
+static void helper_read(int ci);
+static void helper_dead(int ci);
+
+static int helper_start(void)
+{
+	int to_helper[2], from_helper[2];
+	pid_t pid;
+
+	if (pipe2(to_helper, O_CLOEXEC) < 0)
+		goto err;
+	if (pipe2(from_helper, O_CLOEXEC) < 0) {
+		close(to_helper[0]);
+		close(to_helper[1]);
+		goto err;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		close(to_helper[0]);
+		close(to_helper[1]);
+		close(from_helper[0]);
+		close(from_helper[1]);
+		goto err;
+	}
+
+	if (pid == 0) {
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGUSR1, SIG_DFL);
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		if (dup2(to_helper[0], STDIN_FILENO) < 0 ||
+				dup2(from_helper[1], STDOUT_FILENO) < 0)
+			_exit(1);
+		execl("/bin/sh", "sh", "-c",
+				booth_conf->ticket_handler_path, NULL);
+		_exit(127);
+	}
+
+	close(to_helper[0]);
+	close(from_helper[1]);
+
+	helper_ci = client_add(from_helper[0], NULL, helper_read, helper_dead);
+	if (helper_ci < 0) {
+		close(from_helper[0]);
+		close(to_helper[1]);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return -EIO;
+	}
+
+	fcntl(to_helper[1], F_SETFL, fcntl(to_helper[1], F_GETFL) | O_NONBLOCK);
+	helper_in = to_helper[1];
+	helper_pid = pid;
+	in_len = 0;
+
+	log_info("ticket helper \"%s\" started, pid %d",
+			booth_conf->ticket_handler_path, (int)pid);
+	return 0;
+
+err:
+	log_error("cannot start the ticket helper: %s", strerror(errno));
+	return -errno;
+}
+
+
+static void helper_dead(int ci)
+{
+	struct ticket_config *tk;
+	int status;
+	pid_t pid;
+
+	log_error("ticket helper %d went away", (int)helper_pid);
+
+	client_dead(ci);
+	close(helper_in);
+	kill(helper_pid, SIGTERM);
+	while ((pid = waitpid(helper_pid, &status, 0)) < 0 && errno == EINTR)
+		;
+	if (pid < 0)
+		log_error("cannot reap ticket helper: %s", strerror(errno));
+	else
+		log_info("ticket helper exited with %s", interpret_rv(status));
+
+	helper_pid = 0;
+	helper_in = helper_ci = -1;
+	out_len = 0;
+
+	while (pending_len) {
+		tk = pending[pending_head];
+		pending_head = (pending_head + 1) % booth_conf->ticket_count;
+		pending_len--;
+		store_write_done(tk, -EIO);
+	}
+}
+
+
+/** Write as much of the queued requests as the pipe takes. */
+static int helper_flush(void)
+{
+	int rv;
+
+	while (out_len) {
+		rv = write(helper_in, outbuf, out_len);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv == -1 && errno == EAGAIN)
+			/* Retried when the next answer arrives. */
+			return 0;
+		if (rv <= 0) {
+			log_error("writing to the ticket helper failed: %s",
+					strerror(errno));
+			helper_dead(helper_ci);
+			return -EIO;
+		}
+
+		out_len -= rv;
+		memmove(outbuf, outbuf + rv, out_len);
+	}
+
+	return 0;
+}
+
+
+static int helper_queue(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static int helper_queue(const char *fmt, ...)
+{
+	char line[HELPER_LINE_MAX], *buf;
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len >= sizeof(line))
+		return -EINVAL;
+
+	buf = realloc(outbuf, out_len + len);
+	if (!buf)
+		return -ENOMEM;
+
+	memcpy(buf + out_len, line, len);
+	outbuf = buf;
+	out_len += len;
+	return 0;
+}
+
+
+/** Read what the helper sent.
+ * Returns -1 on EOF or errors. */
+static int helper_fill(void)
+{
+	int rv;
+
+	if (in_len == sizeof(inbuf)) {
+		log_error("overlong answer from the ticket helper");
+		return -1;
+	}
+
+	do {
+		rv = read(clients[helper_ci].fd, inbuf + in_len,
+				sizeof(inbuf) - in_len);
+	} while (rv == -1 && errno == EINTR);
+	if (rv <= 0)
+		return -1;
+
+	in_len += rv;
+	return 0;
+}
+
+
+/** Take one line of answer out of the buffer.
+ * Returns 1 if there was a complete line, else 0. */
+static int helper_get_line(char *line)
+{
+	char *nl;
+	int len;
+
+	nl = memchr(inbuf, '\n', in_len);
+	if (!nl)
+		return 0;
+
+	len = nl - inbuf;
+	memcpy(line, inbuf, len);
+	line[len] = '\0';
+
+	in_len -= len + 1;
+	memmove(inbuf, nl + 1, in_len);
+	return 1;
+}
+
+
+static void helper_read(int ci)
+{
+	char line[HELPER_LINE_MAX];
+	struct ticket_config *tk;
+	int rv;
+
+	if (helper_fill() < 0) {
+		helper_dead(ci);
+		return;
+	}
+
+	while (helper_get_line(line)) {
+		if (!pending_len) {
+			log_error("unexpected answer from the ticket helper: %s",
+					line);
+			continue;
+		}
+
+		tk = pending[pending_head];
+		pending_head = (pending_head + 1) % booth_conf->ticket_count;
+		pending_len--;
+
+		if (!strcmp(line, "ok")) {
+			rv = 0;
+		} else {
+			tk_log_error("ticket helper: %s", line);
+			rv = -EIO;
+		}
+		store_write_done(tk, rv);
+	}
+
+	helper_flush();
+}
+
+
+static int helper_submit(struct ticket_config **tks, int count)
+{
+	struct ticket_config *tk;
+	int i, rv;
+
+	if (!helper_pid) {
+		rv = helper_start();
+		if (rv < 0)
+			return rv;
+	}
+
+	for (i = 0; i < count; i++) {
+		tk = tks[i];
+		rv = helper_queue("%s %s %" PRIi32 " %" PRIi64 " %" PRIu32 "\n",
+				tk->cib_leader == local ? "grant" : "revoke",
+				tk->name,
+				(int32_t)get_node_id(tk->cib_leader),
+				(int64_t)wall_ts(tk->cib_expires),
+				tk->cib_term);
+		if (rv < 0) {
+			store_write_done(tk, rv);
+			continue;
+		}
+
+		pending[(pending_head + pending_len) %
+			booth_conf->ticket_count] = tk;
+		pending_len++;
+	}
+
+	helper_flush();
+	return 0;
+}
+
+
+static int helper_load_ticket(struct ticket_config *tk)
+{
+	char line[HELPER_LINE_MAX];
+	struct pollfd pfd;
+	int rv, granted;
+	int32_t owner;
+	int64_t expires;
+	uint32_t term;
+
+	if (!helper_pid) {
+		rv = helper_start();
+		if (rv < 0)
+			return rv;
+	}
+
+	/* Only used at startup, before any updates; so no need to be
+	 * asynchronous here. */
+	assert(!pending_len);
+
+	rv = helper_queue("load %s\n", tk->name);
+	if (rv < 0)
+		return rv;
+
+	while (out_len) {
+		rv = helper_flush();
+		if (rv < 0)
+			return rv;
+		if (!out_len)
+			break;
+
+		/* The pipe is full; wait for the helper to catch up. */
+		pfd.fd = helper_in;
+		pfd.events = POLLOUT;
+		rv = poll(&pfd, 1, HELPER_WRITE_TIMEOUT_MS);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0) {
+			log_error("ticket helper doesn't take requests: %s",
+					rv ? strerror(errno) : "timed out");
+			helper_dead(helper_ci);
+			return -EIO;
+		}
+	}
+
+	while (!helper_get_line(line)) {
+		if (helper_fill() < 0) {
+			helper_dead(helper_ci);
+			return EIO;
+		}
+	}
+
+	if (!strcmp(line, "none"))
+		return ENOENT;
+
+	if (sscanf(line, "ok %d %" SCNi32 " %" SCNi64 " %" SCNu32,
+				&granted, &owner, &expires, &term) != 4) {
+		tk_log_error("ticket helper: %s", line);
+		return EINVAL;
+	}
+
+	tk->term_expires = unwall_ts(expires);
+	tk->current_term = term;
+	tk->is_granted = granted;
+	store_loaded_owner(tk, owner);
+
+	return 0;
+}
+
+
+static int helper_init(void)
+{
+	if (!*booth_conf->ticket_handler_path) {
+		log_error("the helper ticket handler needs a command "
+				"in ticket-handler-path");
+		return -EINVAL;
+	}
+
+	pending = calloc(booth_conf->ticket_count, sizeof(*pending));
+	if (!pending) {
+		log_error("out of memory for the ticket helper");
+		return -ENOMEM;
+	}
+
+	/* Else a dying helper would take us down, too. */
+	signal(SIGPIPE, SIG_IGN);
+
+	return helper_start();
+}
+
+
+struct ticket_handler helper_handler = {
+	.name           = "helper",
+	.init           = helper_init,
+	.load_ticket    = helper_load_ticket,
+	.submit         = helper_submit,
+};
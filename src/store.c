@@ -0,0 +1,460 @@
+/* 
+ * Copyright (C) 2014 Philipp Marek <philipp.marek@linbit.com>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "booth.h"
+#include "config.h"
+#include "pacemaker.h"
+#include "raft.h"
+#include "ticket.h"
+#include "inline-fn.h"
+#include "log.h"
+#include "store.h"
+
+
+/** \file
+ * Asynchronous CIB writer.
+ *
+ * Writing a ticket to the CIB means running crm_ticket (perhaps
+ * several times), which can take quite a while; so this is done in
+ * child processes, and the main loop continues meanwhile.
+ *
+ * ticket_write() only records the state that should go into the CIB
+ * in the ticket (cib_leader etc.) and queues it; at the end of each
+ * main loop iteration all queued tickets are handed to one child,
+ * which writes them with a single CIB update where possible.
+ * Handlers that can work without blocking (see ticket_handler.submit)
+ * get them directly instead.
+ *
+ * A ticket is written by at most one child at a time; if it changes
+ * again in the meantime, only the newest state is written after that
+ * child finished.
+ */
+
+
+static struct ticket_handler *handlers[] = {
+	&pcmk_handler,
+	&file_handler,
+	&helper_handler,
+	NULL,
+};
+
+static struct ticket_handler *handler = &pcmk_handler;
+
+
+struct store_worker {
+	pid_t pid;
+	/** Index in clients[] of the result pipe. */
+	int ci;
+	/** The tickets being written. */
+	struct ticket_config **tks;
+	int count;
+};
+
+static struct store_worker workers[STORE_WORKERS_MAX];
+static int workers_busy;
+
+/** Tickets waiting to be written, a ring buffer.
+ * A ticket is in here at most once (see cib_queued), so room for
+ * all tickets is enough. */
+static struct ticket_config **queue;
+static int queue_head, queue_len;
+
+
+static int queue_ticket(struct ticket_config *tk)
+{
+	int size = booth_conf->ticket_count;
+
+	if (!queue) {
+		queue = calloc(size, sizeof(*queue));
+		if (!queue) {
+			log_error("out of memory for the CIB write queue");
+			return -ENOMEM;
+		}
+	}
+
+	queue[(queue_head + queue_len) % size] = tk;
+	queue_len++;
+	tk->cib_queued = 1;
+	return 0;
+}
+
+
+static struct ticket_config *dequeue_ticket(void)
+{
+	struct ticket_config *tk;
+
+	tk = queue[queue_head];
+	queue_head = (queue_head + 1) % booth_conf->ticket_count;
+	queue_len--;
+	tk->cib_queued = 0;
+	return tk;
+}
+
+
+/** Write the recorded states via the ticket handler, in one go.
+ * The result for each ticket is put into rv[]. */
+static void write_tickets(struct ticket_config **tks, int count, int *rv)
+{
+	struct ticket_config *copies, **list;
+	int i;
+
+	copies = malloc(count * sizeof(*copies));
+	list = malloc(count * sizeof(*list));
+	if (!copies || !list) {
+		log_error("out of memory for CIB update");
+		for (i = 0; i < count; i++)
+			rv[i] = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		copies[i] = *tks[i];
+		copies[i].leader = tks[i]->cib_leader;
+		copies[i].term_expires = tks[i]->cib_expires;
+		copies[i].current_term = tks[i]->cib_term;
+		list[i] = copies + i;
+	}
+
+	handler->write_tickets(list, count, rv);
+
+out:
+	free(copies);
+	free(list);
+}
+
+
+/** Called with the result of writing a ticket. */
+void store_write_done(struct ticket_config *tk, int rv)
+{
+	tk->cib_busy = 0;
+
+	if (rv) {
+		tk_log_error("writing the ticket to the CIB failed (%d), "
+				"will retry", rv);
+	} else {
+		tk_log_debug("ticket written to the CIB");
+	}
+
+	/* Changed again meanwhile? */
+	if (tk->cib_dirty && !tk->cib_queued)
+		queue_ticket(tk);
+
+	raft_ticket_written(tk, rv);
+	ticket_write_done(tk, rv);
+}
+
+
+/** @rv may be NULL if there was no memory for the results. */
+static void worker_finished(struct store_worker *w, int *rv)
+{
+	int i;
+
+	for (i = 0; i < w->count; i++)
+		store_write_done(w->tks[i], rv ? rv[i] : -ENOMEM);
+
+	free(w->tks);
+	w->tks = NULL;
+	w->pid = 0;
+}
+
+
+static struct store_worker *find_worker(int ci)
+{
+	int i;
+
+	for (i = 0; i < STORE_WORKERS_MAX; i++)
+		if (workers[i].pid && workers[i].ci == ci)
+			return workers + i;
+	return NULL;
+}
+
+
+/** Callback for the result pipe of a worker.
+ * Gets called with the results, or on EOF. */
+static void worker_done(int ci)
+{
+	struct store_worker *w;
+	int *rv, i, status;
+	pid_t pid;
+
+	w = find_worker(ci);
+	if (!w) {
+		client_dead(ci);
+		return;
+	}
+
+	/* Without memory for the results the writer still has to be
+	 * reaped; its tickets are taken as not written then. */
+	rv = malloc(w->count * sizeof(*rv));
+	if (!rv) {
+		log_error("out of memory for CIB update results");
+	} else if (do_read(clients[ci].fd, rv, w->count * sizeof(*rv)) < 0) {
+		/* The results are written in one go just before
+		 * _exit(), so this won't block for long. */
+		for (i = 0; i < w->count; i++)
+			rv[i] = -EIO;
+	}
+	client_dead(ci);
+
+	while ((pid = waitpid(w->pid, &status, 0)) < 0 && errno == EINTR)
+		;
+	if (pid < 0) {
+		/* No exit status to go by; don't trust the results. */
+		log_error("cannot reap CIB writer %d: %s",
+				(int)w->pid, strerror(errno));
+		for (i = 0; rv && i < w->count; i++)
+			rv[i] = -EIO;
+	} else if (status) {
+		log_error("CIB writer %d failed: %s",
+				(int)w->pid, interpret_rv(status));
+	}
+
+	workers_busy--;
+	worker_finished(w, rv);
+	free(rv);
+}
+
+
+static void start_worker(struct ticket_config **tks, int count)
+{
+	struct store_worker *w;
+	int fds[2], *rv, i, ok, status;
+	pid_t pid = -1;
+
+	for (i = 0; i < STORE_WORKERS_MAX && workers[i].pid; i++)
+		;
+	w = workers + i;
+	w->tks = tks;
+	w->count = count;
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		log_error("cannot create pipe: %s", strerror(errno));
+		goto sync;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		log_error("cannot fork: %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		goto sync;
+	}
+
+	if (pid == 0) {
+		/* Don't run the daemon's handlers in here. */
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGUSR1, SIG_DFL);
+		signal(SIGCHLD, SIG_DFL);
+		close(fds[0]);
+
+		rv = malloc(count * sizeof(*rv));
+		if (!rv)
+			_exit(1);
+		write_tickets(tks, count, rv);
+		ok = do_write(fds[1], rv, count * sizeof(*rv));
+		_exit(ok < 0 ? 1 : 0);
+	}
+
+	close(fds[1]);
+	w->ci = client_add(fds[0], NULL, worker_done, worker_done);
+	if (w->ci < 0) {
+		/* Can't watch it; just wait for it. */
+		close(fds[0]);
+		while ((ok = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+			;
+		/* Not reaped counts as failed, too. */
+		status = (ok < 0 || status) ? -EIO : 0;
+		goto done;
+	}
+
+	w->pid = pid;
+	workers_busy++;
+	log_debug("CIB writer %d started for %d ticket(s)", (int)pid, count);
+	return;
+
+sync:
+	status = 0;
+done:
+	rv = malloc(count * sizeof(*rv));
+	if (!rv) {
+		log_error("out of memory for CIB update results");
+		for (i = 0; i < count; i++)
+			store_write_done(tks[i], -ENOMEM);
+		free(tks);
+		w->tks = NULL;
+		return;
+	}
+	for (i = 0; i < count; i++)
+		rv[i] = status;
+	if (pid < 0)
+		write_tickets(tks, count, rv);
+	worker_finished(w, rv);
+	free(rv);
+}
+
+
+/** Schedule writing the current state of the ticket to the CIB.
+ * Only recorded here; see store_flush(). */
+int store_ticket_write(struct ticket_config *tk)
+{
+	if (tk->cib_dirty)
+		tk_log_debug("superseding a pending CIB update");
+
+	tk->cib_leader = tk->leader;
+	tk->cib_expires = tk->term_expires;
+	tk->cib_term = tk->current_term;
+	tk->cib_dirty = 1;
+
+	if (!tk->cib_busy && !tk->cib_queued)
+		return queue_ticket(tk);
+
+	return 0;
+}
+
+
+/** Write all pending tickets.
+ * Called once per main loop iteration, so that all the changes of
+ * one round (eg. many tickets expiring at once) go into a single
+ * CIB update. */
+void store_flush(void)
+{
+	struct ticket_config **tks, *tk;
+	int count, i, rv;
+
+	if (!queue_len)
+		return;
+	if (!handler->submit && workers_busy >= STORE_WORKERS_MAX)
+		return;
+
+	tks = malloc(queue_len * sizeof(*tks));
+	if (!tks) {
+		log_error("out of memory for CIB update");
+		return;
+	}
+
+	count = 0;
+	while (queue_len) {
+		tk = dequeue_ticket();
+		/* Might have been written meanwhile. */
+		if (tk->cib_dirty && !tk->cib_busy) {
+			tk->cib_dirty = 0;
+			tk->cib_busy = 1;
+			tks[count++] = tk;
+		}
+	}
+
+	if (!count) {
+		free(tks);
+		return;
+	}
+
+	if (!handler->submit) {
+		start_worker(tks, count);
+		return;
+	}
+
+	rv = handler->submit(tks, count);
+	if (rv < 0) {
+		for (i = 0; i < count; i++)
+			store_write_done(tks[i], rv);
+	}
+	free(tks);
+}
+
+
+/** Set the ticket owner as found in the CIB. */
+void store_loaded_owner(struct ticket_config *tk, uint32_t site_id)
+{
+	/* No check, node could have been deconfigured. */
+	if (!find_site_by_id(site_id, &tk->leader)) {
+		/* Hmm, no site found for the ticket we have in the
+		 * CIB!?
+		 * Assume that the ticket belonged to us if it was
+		 * granted here!
+		 */
+		tk_log_warn("no site matches; site got reconfigured?");
+		if (tk->is_granted) {
+			tk_log_warn("granted here, assume it belonged to us");
+			tk->leader = local;
+		}
+	}
+}
+
+
+/** Load all tickets.
+ * res[] gets 0 for every ticket for which some state was found. */
+int store_load_tickets(int *res)
+{
+	struct ticket_config **tks, *tk;
+	int i, count = booth_conf->ticket_count;
+
+	for (i = 0; i < count; i++)
+		res[i] = EAGAIN;
+
+	if (handler->load_tickets) {
+		tks = malloc(count * sizeof(*tks));
+		if (tks) {
+			foreach_ticket(i, tk)
+				tks[i] = tk;
+			handler->load_tickets(tks, count, res);
+			free(tks);
+		}
+	}
+
+	/* Only ask again where it's still unknown. */
+	foreach_ticket(i, tk) {
+		if (res[i] && res[i] != ENOENT)
+			res[i] = handler->load_ticket(tk);
+	}
+
+	return 0;
+}
+
+
+/** Choose the configured ticket handler. */
+int store_init(void)
+{
+	int i;
+
+	for (i = 0; handlers[i]; i++) {
+		if (!strcmp(handlers[i]->name, booth_conf->ticket_handler))
+			break;
+	}
+	if (!handlers[i]) {
+		log_error("unknown ticket handler \"%s\"",
+				booth_conf->ticket_handler);
+		return -EINVAL;
+	}
+
+	handler = handlers[i];
+	log_info("using the \"%s\" ticket handler", handler->name);
+
+	if (handler->init)
+		return handler->init();
+	return 0;
+}
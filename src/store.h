@@ -0,0 +1,64 @@
+/* 
+ * Copyright (C) 2014 Philipp Marek <philipp.marek@linbit.com>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _STORE_H
+#define _STORE_H
+
+#include <stdint.h>
+#include "config.h"
+
+/** Max. number of processes writing tickets to the CIB at once. */
+#define STORE_WORKERS_MAX	4
+
+/** A backend that keeps the ticket state in the cluster.
+ * Selected via "ticket-handler" in the configuration. */
+struct ticket_handler {
+	const char *name;
+	/** Called once at startup, before the tickets are loaded. */
+	int (*init) (void);
+	int (*grant_ticket) (struct ticket_config *tk);
+	int (*revoke_ticket) (struct ticket_config *tk);
+	int (*load_ticket) (struct ticket_config *tk);
+	/** Loads several tickets at once; res[] gets 0 for a loaded
+	 * ticket, ENOENT if there's no state for it, and anything
+	 * else if it has to be loaded via load_ticket(). Optional. */
+	int (*load_tickets) (struct ticket_config **tks, int count, int *res);
+	/** Writes several tickets; the results go into res[].
+	 * This may block, so it's run in a child process. */
+	int (*write_tickets) (struct ticket_config **tks, int count, int *res);
+	/** Starts writing the tickets (the state is in their cib_*
+	 * fields) without blocking; store_write_done() has to be called
+	 * for each of them later on. Used instead of write_tickets()
+	 * if set. */
+	int (*submit) (struct ticket_config **tks, int count);
+};
+
+extern struct ticket_handler pcmk_handler;
+extern struct ticket_handler file_handler;
+extern struct ticket_handler helper_handler;
+
+int store_init(void);
+int store_load_tickets(int *res);
+void store_loaded_owner(struct ticket_config *tk, uint32_t site_id);
+int store_ticket_write(struct ticket_config *tk);
+void store_write_done(struct ticket_config *tk, int rv);
+void store_flush(void);
+
+
+#endif /* _STORE_H */
@@ -34,6 +34,7 @@
 #include "booth.h"
 #include "raft.h"
 #include "handler.h"
+#include "store.h"
 
 #define TK_LINE			256
 
@@ -55,15 +56,13 @@ int find_ticket_by_name(const char *ticket, struct ticket_config **found)
 	if (found)
 		*found = NULL;
 
-	for (i = 0; i < booth_conf->ticket_count; i++) {
-		if (!strcmp(booth_conf->ticket[i].name, ticket)) {
-			if (found)
-				*found = booth_conf->ticket + i;
-			return 1;
-		}
-	}
+	i = ticket_hash_find(ticket);
+	if (i < 0)
+		return 0;
 
-	return 0;
+	if (found)
+		*found = booth_conf->ticket + i;
+	return 1;
 }
 
 
@@ -100,55 +99,136 @@ int ticket_write(struct ticket_config *tk)
 	if (local->type != SITE)
 		return -EINVAL;
 
-	if (tk->leader == local) {
-		pcmk_handler.grant_ticket(tk);
-	} else {
-		pcmk_handler.revoke_ticket(tk);
-	}
+	/* Done asynchronously. */
 	tk->update_cib = 0;
-
-	return 0;
+	return store_ticket_write(tk);
 }
 
 
-/* Ask an external program whether getting the ticket
- * makes sense.
-* Eg. if the services have a failcount of INFINITY,
-* we can't serve here anyway. */
-int test_external_prog(struct ticket_config *tk,
+/* The external program said that getting the ticket doesn't
+ * make sense. Eg. if the services have a failcount of INFINITY,
+ * we can't serve here anyway. */
+static void ext_prog_failed(struct ticket_config *tk,
 		int start_election)
 {
-	int rv;
+	tk_log_warn("we are not allowed to acquire ticket");
 
-	rv = run_handler(tk, tk->ext_verifier, 1);
-	if (rv) {
-		tk_log_warn("we are not allowed to acquire ticket");
-
-		/* Give it to somebody else.
-		 * Just send a VOTE_FOR message, so the
-		 * others can start elections. */
-		if (leader_and_valid(tk)) {
-			reset_ticket(tk);
-			ticket_write(tk);
-			if (start_election) {
-				ticket_broadcast(tk, OP_VOTE_FOR, OP_REQ_VOTE, RLT_SUCCESS, OR_LOCAL_FAIL);
-			}
+	/* Give it to somebody else.
+	 * Just send a VOTE_FOR message, so the
+	 * others can start elections. */
+	if (leader_and_valid(tk)) {
+		reset_ticket(tk);
+		ticket_write(tk);
+		if (start_election) {
+			ticket_broadcast(tk, OP_VOTE_FOR, OP_REQ_VOTE, RLT_SUCCESS, OR_LOCAL_FAIL);
 		}
 	}
+}
 
-	return rv;
+
+static void renew_ticket(struct ticket_config *tk)
+{
+	ticket_broadcast(tk, OP_HEARTBEAT, OP_ACK, RLT_SUCCESS, 0);
+	ticket_activate_timeout(tk);
 }
 
 
 /* Try to acquire a ticket
  * Could be manual grant or after ticket loss
+ * If there's a before-acquire-handler, it's started, and the rest
+ * happens in ticket_verified(); RLT_MORE is returned then.
  */
 int acquire_ticket(struct ticket_config *tk, cmd_reason_t reason)
 {
-	if (test_external_prog(tk, 0))
+	int rv;
+
+	if (!tk->ext_verifier)
+		return new_election(tk, local, 1, reason);
+
+	if (tk->verify_for) {
+		tk_log_info("before-acquire-handler still running");
+		return RLT_BUSY;
+	}
+
+	tk->verify_reason = reason;
+	rv = run_handler(tk, VERIFY_ACQUIRE);
+	if (rv < 0) {
+		ext_prog_failed(tk, 0);
 		return RLT_EXT_FAILED;
+	}
+	return RLT_MORE;
+}
 
-	return new_election(tk, local, 1, reason);
+
+/* Send the result of a grant to the client(s) waiting for it. */
+static void answer_grant_waiting(struct ticket_config *tk, int rv)
+{
+	struct boothc_ticket_msg *msg;
+	int ci;
+
+	while ((ci = client_waiting_for(tk)) >= 0) {
+		msg = clients[ci].msg;
+		init_header(&msg->header, CMR_GRANT, 0, 0, rv, 0, sizeof(*msg));
+		send_ticket_msg(ci, msg);
+		client_resume(ci);
+	}
+}
+
+
+/** The before-acquire-handler finished.
+ * rv is its exit status; continues with whatever was started.
+ * See run_handler(). */
+void ticket_verified(struct ticket_config *tk, int for_what, int rv)
+{
+	timetype last_cron;
+
+	last_cron = tk->next_cron;
+
+	switch (for_what) {
+	case VERIFY_RENEW:
+		/* Might have changed meanwhile. */
+		if (tk->state != ST_LEADER || tk->leader != local ||
+				tk->acks_expected) {
+			tk_log_info("not renewing anymore, ignoring "
+					"the before-acquire-handler result");
+			break;
+		}
+
+		if (rv)
+			ext_prog_failed(tk, 1);
+		else
+			renew_ticket(tk);
+		break;
+
+	case VERIFY_ACQUIRE:
+		if (rv) {
+			ext_prog_failed(tk, 0);
+			rv = RLT_EXT_FAILED;
+		} else if (tk->leader == local) {
+			rv = RLT_SUCCESS;
+		} else if (is_owned(tk)) {
+			tk_log_info("got granted elsewhere meanwhile");
+			rv = RLT_OVERGRANT;
+		} else {
+			rv = new_election(tk, local, 1, tk->verify_reason) ?:
+				RLT_ASYNC;
+		}
+
+		if (tk->verify_reason == OR_ADMIN) {
+			if (rv != RLT_ASYNC)
+				tk->delay_commit = 0;
+			answer_grant_waiting(tk, rv);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	if (!tk->in_election && tk->update_cib)
+		ticket_write(tk);
+	if (!time_cmp(&last_cron, &tk->next_cron, !=))
+		set_ticket_wakeup(tk);
 }
 
 
@@ -165,6 +245,12 @@ int do_grant_ticket(struct ticket_config *tk, int options)
 	if (is_owned(tk))
 		return RLT_OVERGRANT;
 
+	/* A grant is pending already; its delay_commit stays as it is. */
+	if (tk->verify_for) {
+		tk_log_info("before-acquire-handler still running");
+		return RLT_BUSY;
+	}
+
 	tk->delay_commit = get_secs(NULL) +
 			tk->term_duration + tk->acquire_after;
 
@@ -176,7 +262,7 @@ int do_grant_ticket(struct ticket_config *tk, int options)
 	}
 
 	rv = acquire_ticket(tk, OR_ADMIN);
-	if (rv)
+	if (rv && rv != RLT_MORE && rv != RLT_BUSY)
 		tk->delay_commit = 0;
 	return rv;
 }
@@ -186,11 +272,56 @@ static int start_revoke_ticket(struct ticket_config *tk)
 {
 	tk_log_info("revoking ticket");
 
+	int rv;
+
 	reset_ticket(tk);
 	tk->leader = no_leader;
 	ticket_write(tk);
+	rv = ticket_broadcast(tk, OP_REVOKE, OP_ACK, RLT_SUCCESS, OR_ADMIN);
 	ticket_activate_timeout(tk);
-	return ticket_broadcast(tk, OP_REVOKE, OP_ACK, RLT_SUCCESS, OR_ADMIN);
+	return rv;
+}
+
+/* Planned migration: give the ticket to @to in the next term. Once a
+ * majority acknowledged that (OP_HANDOVER), @to is told to take it
+ * over (OP_TAKEOVER) and commits right away; no elections needed.
+ * See process_HANDOVER() and process_TAKEOVER(). */
+static int start_handover(struct ticket_config *tk, struct booth_site *to)
+{
+	tk_log_info("handing the ticket over to %s", site_string(to));
+
+	tk->current_term++;
+	tk->leader = to;
+	tk->voted_for = to;
+	tk->state = ST_FOLLOWER;
+	tk->is_granted = 0;
+	tk->term_expires = get_secs(NULL) + tk->term_duration;
+	ticket_write(tk);
+
+	ticket_broadcast(tk, OP_HANDOVER, OP_ACK, RLT_SUCCESS, OR_ADMIN);
+	ticket_activate_timeout(tk);
+	return 0;
+}
+
+/** Ticket migration.
+ * Only to be started from the leader. */
+static int do_migrate_ticket(struct ticket_config *tk, struct booth_site *to)
+{
+	/* Acks to a heartbeat don't matter once the ticket is handed
+	 * over, but a change of its state has to finish first. */
+	if (tk->verify_for || tk->next_state ||
+			(tk->acks_expected && tk->last_request != OP_HEARTBEAT)) {
+		tk_log_info("not migrating, another operation is running");
+		return RLT_BUSY;
+	}
+
+	if (to->down) {
+		tk_log_warn("not migrating, %s is not reachable",
+				site_string(to));
+		return RLT_SYNC_FAIL;
+	}
+
+	return start_handover(tk, to);
 }
 
 /** Ticket revoke.
@@ -270,6 +401,228 @@ int list_ticket(char **pdata, unsigned int *len)
 	return 0;
 }
 
+/** Timer heap.
+ * A binary min-heap of the tickets, ordered by next_cron; so the main
+ * loop only needs to look at the first entry to know when to wake up,
+ * and only the tickets that are due get processed.
+ * The entries carry a copy of next_cron, so that sifting through the
+ * heap stays within this (dense) array and doesn't have to touch the
+ * tickets themselves, apart from the ones being moved.
+ * Tickets that are being processed are not in the heap (timer_pos is
+ * 0), they get re-queued afterwards. */
+struct timer_entry {
+	timetype when;
+	struct ticket_config *tk;
+};
+
+static struct timer_entry *timer_heap;
+static int timer_heap_len;
+/* Tickets taken off the heap in process_tickets(). */
+static struct ticket_config **timer_due;
+
+static void timer_heap_set(int pos, struct timer_entry *e)
+{
+	timer_heap[pos - 1] = *e;
+	e->tk->timer_pos = pos;
+}
+
+static void timer_heap_up(int pos)
+{
+	struct timer_entry e, *parent;
+
+	e = timer_heap[pos - 1];
+	while (pos > 1) {
+		parent = timer_heap + pos/2 - 1;
+		if (!time_cmp(&parent->when, &e.when, >))
+			break;
+		timer_heap_set(pos, parent);
+		pos /= 2;
+	}
+	timer_heap_set(pos, &e);
+}
+
+static void timer_heap_down(int pos)
+{
+	struct timer_entry e, *child;
+	int c;
+
+	e = timer_heap[pos - 1];
+	while ((c = pos*2) <= timer_heap_len) {
+		child = timer_heap + c - 1;
+		if (c < timer_heap_len &&
+				time_cmp(&child[1].when, &child->when, <)) {
+			c++;
+			child++;
+		}
+		if (!time_cmp(&child->when, &e.when, <))
+			break;
+		timer_heap_set(pos, child);
+		pos = c;
+	}
+	timer_heap_set(pos, &e);
+}
+
+static void timer_heap_insert(struct ticket_config *tk)
+{
+	struct timer_entry e;
+
+	e.when = tk->next_cron;
+	e.tk = tk;
+	timer_heap_len++;
+	timer_heap_set(timer_heap_len, &e);
+	timer_heap_up(timer_heap_len);
+}
+
+static struct ticket_config *timer_heap_pop(void)
+{
+	struct ticket_config *tk;
+
+	tk = timer_heap[0].tk;
+	tk->timer_pos = 0;
+	timer_heap_len--;
+	if (timer_heap_len) {
+		timer_heap_set(1, timer_heap + timer_heap_len);
+		timer_heap_down(1);
+	}
+	return tk;
+}
+
+static void timer_heap_remove(struct ticket_config *tk)
+{
+	int pos = tk->timer_pos;
+
+	tk->timer_pos = 0;
+	timer_heap_len--;
+	if (pos > timer_heap_len)
+		return;
+
+	timer_heap_set(pos, timer_heap + timer_heap_len);
+	if (pos > 1 &&
+			time_cmp(&timer_heap[pos - 1].when,
+				&timer_heap[pos/2 - 1].when, <))
+		timer_heap_up(pos);
+	else
+		timer_heap_down(pos);
+}
+
+static int timer_heap_init(void)
+{
+	timer_heap = calloc(booth_conf->ticket_count + 1, sizeof(*timer_heap));
+	timer_due = calloc(booth_conf->ticket_count + 1, sizeof(*timer_due));
+	if (!timer_heap || !timer_due) {
+		log_error("can't alloc ticket timer heap");
+		return -ENOMEM;
+	}
+
+	timer_heap_len = 0;
+	return 0;
+}
+
+/* Re-key the ticket after next_cron changed. */
+void ticket_timer_update(struct ticket_config *tk)
+{
+	int pos = tk->timer_pos;
+
+	if (!pos)
+		return;
+
+	timer_heap[pos - 1].when = tk->next_cron;
+	if (pos > 1 &&
+			time_cmp(&tk->next_cron, &timer_heap[pos/2 - 1].when, <))
+		timer_heap_up(pos);
+	else
+		timer_heap_down(pos);
+}
+
+/* Nothing to do for the ticket until someone asks for it. */
+static int ticket_idle(struct ticket_config *tk)
+{
+	return tk->state == ST_INIT &&
+		!is_owned(tk) &&
+		!tk->acks_expected &&
+		!tk->next_state &&
+		!tk->in_election &&
+		!tk->start_postpone &&
+		!tk->update_cib &&
+		!tk->cib_dirty &&
+		!tk->cib_queued &&
+		!tk->cib_busy &&
+		!tk->verify_for;
+}
+
+/* Take an idle ticket off the heap; one that is being processed right
+ * now is left to process_tickets(). */
+static void ticket_maybe_sleep(struct ticket_config *tk)
+{
+	if (!tk->timer_pos || !ticket_idle(tk))
+		return;
+
+	tk_log_debug("ticket is idle, going dormant");
+	timer_heap_remove(tk);
+	tk->dormant = 1;
+}
+
+/* A client or a peer refers to a dormant ticket: schedule it again. */
+static void ticket_wakeup(struct ticket_config *tk)
+{
+	timetype now;
+
+	if (!tk->dormant)
+		return;
+
+	tk_log_debug("waking up dormant ticket");
+	tk->dormant = 0;
+	get_time(&now);
+	tk->next_cron = now;
+	timer_heap_insert(tk);
+}
+
+/* Called by store_write_done(). A failed write is tried again by
+ * ticket_cron() after the network timeout, even if the ticket had
+ * nothing else to do; after a successful one the ticket may be idle
+ * now. */
+void ticket_write_done(struct ticket_config *tk, int rv)
+{
+	timetype tv;
+
+	if (!rv) {
+		ticket_maybe_sleep(tk);
+		return;
+	}
+
+	tk->update_cib = 1;
+	get_time(&tv);
+	tv.tv_sec += tk->timeout;
+
+	if (tk->dormant) {
+		ticket_wakeup(tk);
+		ticket_next_cron_at(tk, tv);
+	} else if (time_cmp(&tv, &tk->next_cron, <)) {
+		ticket_next_cron_at(tk, tv);
+	}
+}
+
+/* Milliseconds until the next ticket is due, -1 for "nothing to do". */
+int tickets_next_timeout(void)
+{
+	timetype now, res;
+	long ms;
+
+	if (!timer_heap_len)
+		return -1;
+
+	get_time(&now);
+	if (!time_cmp(&timer_heap[0].when, &now, >))
+		return 0;
+
+	time_sub(&timer_heap[0].when, &now, &res);
+	if (res.tv_sec > 3600)
+		return 3600 * 1000;
+	/* round up, to not wake up just before the deadline */
+	ms = res.tv_sec * 1000 + msecs(res) + 1;
+	return ms;
+}
+
 void reset_ticket(struct ticket_config *tk)
 {
 	disown_ticket(tk);
@@ -372,30 +725,62 @@ void update_ticket_state(struct ticket_config *tk, struct booth_site *sender)
 int setup_ticket(void)
 {
 	struct ticket_config *tk;
-	int i;
+	int i, rv, *loaded = NULL;
+
+	rv = timer_heap_init();
+	if (rv < 0)
+		return rv;
 
 	foreach_ticket(i, tk) {
 		reset_ticket(tk);
+	}
 
-		if (local->type == SITE) {
-			if (!pcmk_handler.load_ticket(tk)) {
-				update_ticket_state(tk, NULL);
-			}
-			tk->update_cib = 1;
+	if (local->type == SITE) {
+		rv = store_init();
+		if (rv < 0)
+			return rv;
+
+		/* All at once, if the handler can do that. */
+		loaded = malloc(booth_conf->ticket_count * sizeof(*loaded));
+		if (!loaded) {
+			log_error("out of memory loading tickets");
+			return -ENOMEM;
+		}
+		store_load_tickets(loaded);
+	}
+
+	foreach_ticket(i, tk) {
+		/* Tickets which the CIB doesn't know about or which
+		 * are not granted stay dormant; should one be granted
+		 * elsewhere, the leader's heartbeat wakes it up. The
+		 * arbitrator has no CIB, so it learns everything that
+		 * way. If loading failed, better ask around. */
+		if (local->type != SITE ||
+				loaded[i] == ENOENT ||
+				(!loaded[i] && !is_owned(tk))) {
+			tk->dormant = 1;
+			continue;
 		}
 
+		if (!loaded[i]) {
+			update_ticket_state(tk, NULL);
+		}
+		tk->update_cib = 1;
+
 		tk_log_info("broadcasting state query");
 		/* wait until all send their status (or the first
 		 * timeout) */
 		tk->start_postpone = 1;
 		ticket_broadcast(tk, OP_STATUS, OP_MY_INDEX, RLT_SUCCESS, 0);
+		timer_heap_insert(tk);
 	}
 
+	free(loaded);
 	return 0;
 }
 
 
-int ticket_answer_list(int fd, struct boothc_ticket_msg *msg)
+int ticket_answer_list(int ci, struct boothc_ticket_msg *msg)
 {
 	char *data;
 	int olen, rv;
@@ -407,11 +792,34 @@ int ticket_answer_list(int fd, struct boothc_ticket_msg *msg)
 
 	init_header(&hdr, CMR_LIST, 0, 0, RLT_SUCCESS, 0, sizeof(hdr) + olen);
 
-	return send_header_plus(fd, &hdr, data, olen);
+	rv = send_header_plus(ci, &hdr, data, olen);
+	free(data);
+	return rv;
 }
 
 
-int ticket_answer_grant(int fd, struct boothc_ticket_msg *msg)
+int ticket_answer_stats(int ci, struct boothc_ticket_msg *msg)
+{
+	char data[256];
+	int len;
+	struct boothc_header hdr;
+
+	len = snprintf(data, sizeof(data),
+			"resends: %lu\n"
+			"resends saved: %lu\n"
+			"elections: %lu\n"
+			"election rounds: %lu\n",
+			ticket_stats.resends,
+			ticket_stats.resends_saved,
+			ticket_stats.elections,
+			ticket_stats.election_rounds);
+
+	init_header(&hdr, CMR_STATS, 0, 0, RLT_SUCCESS, 0, sizeof(hdr) + len);
+	return send_header_plus(ci, &hdr, data, len);
+}
+
+
+int ticket_answer_grant(int ci, struct boothc_ticket_msg *msg)
 {
 	int rv;
 	struct ticket_config *tk;
@@ -423,6 +831,7 @@ int ticket_answer_grant(int fd, struct boothc_ticket_msg *msg)
 		rv = RLT_INVALID_ARG;
 		goto reply;
 	}
+	ticket_wakeup(tk);
 
 	if (is_owned(tk)) {
 		log_warn("client wants to grant an (already granted!) ticket %s",
@@ -432,14 +841,19 @@ int ticket_answer_grant(int fd, struct boothc_ticket_msg *msg)
 	}
 
 	rv = do_grant_ticket(tk, ntohl(msg->header.options));
+	if (rv == RLT_MORE) {
+		/* Answered in ticket_verified(). */
+		client_wait(ci, tk);
+		return 0;
+	}
 
 reply:
 	init_header(&msg->header, CMR_GRANT, 0, 0, rv ?: RLT_ASYNC, 0, sizeof(*msg));
-	return send_ticket_msg(fd, msg);
+	return send_ticket_msg(ci, msg);
 }
 
 
-int ticket_answer_revoke(int fd, struct boothc_ticket_msg *msg)
+int ticket_answer_revoke(int ci, struct boothc_ticket_msg *msg)
 {
 	int rv;
 	struct ticket_config *tk;
@@ -472,7 +886,58 @@ int ticket_answer_revoke(int fd, struct boothc_ticket_msg *msg)
 
 reply:
 	init_ticket_msg(msg, CMR_REVOKE, 0, rv, 0, tk);
-	return send_ticket_msg(fd, msg);
+	return send_ticket_msg(ci, msg);
+}
+
+
+int ticket_answer_migrate(int ci, struct boothc_ticket_msg *msg)
+{
+	int rv;
+	struct ticket_config *tk;
+	struct booth_site *to;
+
+	if (!check_ticket(msg->ticket.id, &tk)) {
+		log_warn("client wants to migrate an unknown ticket %s",
+				msg->ticket.id);
+		rv = RLT_INVALID_ARG;
+		goto reply;
+	}
+
+	if (!is_owned(tk)) {
+		log_info("client wants to migrate a free ticket %s",
+				msg->ticket.id);
+		rv = RLT_TICKET_IDLE;
+		goto reply;
+	}
+
+	if (tk->leader != local) {
+		log_info("the ticket %s is not granted here, "
+				"redirect to %s",
+				msg->ticket.id, ticket_leader_string(tk));
+		rv = RLT_REDIRECT;
+		goto reply;
+	}
+
+	if (!find_site_by_id(ntohl(msg->ticket.leader), &to) ||
+			to->type != SITE) {
+		log_warn("client wants to migrate ticket %s "
+				"to an unknown site", msg->ticket.id);
+		rv = RLT_INVALID_ARG;
+		goto reply;
+	}
+
+	if (to == local) {
+		rv = RLT_SUCCESS;
+		goto reply;
+	}
+
+	rv = do_migrate_ticket(tk, to);
+	if (rv == 0)
+		rv = RLT_ASYNC;
+
+reply:
+	init_ticket_msg(msg, CMR_MIGRATE, 0, rv, 0, tk);
+	return send_ticket_msg(ci, msg);
 }
 
 
@@ -569,7 +1034,10 @@ static void log_lost_servers(struct ticket_config *tk)
 
 	for (i = 0; i < booth_conf->site_count; i++) {
 		n = booth_conf->site + i;
-		if (!(tk->acks_received & n->bitmask)) {
+		/* already reported, see process_peer_timeouts() */
+		if (n->down)
+			continue;
+		if (!siteset_has(tk->acks_received, n)) {
 			tk_log_warn("%s %s didn't acknowledge our request, "
 			"will retry %d times",
 			(n->type == ARBITRATOR ? "arbitrator" : "site"),
@@ -579,32 +1047,88 @@ static void log_lost_servers(struct ticket_config *tk)
 	}
 }
 
+/* Peers that are down get nothing; tickets_peer_up() catches up
+ * with them when they're back. */
 static void resend_msg(struct ticket_config *tk)
 {
 	struct booth_site *n;
 	int i;
 
-	if (!(tk->acks_received ^ local->bitmask)) {
-		ticket_broadcast(tk, tk->last_request, 0, RLT_SUCCESS, 0);
-	} else {
-		for (i = 0; i < booth_conf->site_count; i++) {
-			n = booth_conf->site + i;
-			if (!(tk->acks_received & n->bitmask)) {
-				tk_log_debug("resending %s to %s",
-						state_to_string(tk->last_request),
-						site_string(n)
-						);
-				send_msg(tk->last_request, tk, n, NULL);
-			}
+	for (i = 0; i < booth_conf->site_count; i++) {
+		n = booth_conf->site + i;
+		if (siteset_has(tk->acks_received, n))
+			continue;
+		if (n->down) {
+			ticket_stats.resends_saved++;
+			continue;
 		}
+
+		ticket_stats.resends++;
+		tk_log_debug("resending %s to %s",
+				state_to_string(tk->last_request),
+				site_string(n)
+				);
+		send_msg(tk->last_request, tk, n, NULL);
+	}
+}
+
+/* A peer that was down is back; don't let it wait for the next
+ * retry. */
+void tickets_peer_up(struct booth_site *site)
+{
+	struct ticket_config *tk;
+	int i;
+
+	foreach_ticket(i, tk) {
+		if (!tk->acks_expected ||
+				siteset_has(tk->acks_received, site))
+			continue;
+
+		tk_log_debug("%s is back, resending %s",
+				site_string(site),
+				state_to_string(tk->last_request));
+		send_msg(tk->last_request, tk, site, NULL);
+	}
+}
+
+/* A peer is gone; if it led some tickets, find a successor while
+ * their terms still run. */
+void tickets_peer_down(struct booth_site *site)
+{
+	struct ticket_config *tk;
+	int i;
+
+	if (local->type != SITE)
+		return;
+
+	foreach_ticket(i, tk) {
+		if (tk->leader != site || tk->state != ST_FOLLOWER ||
+				tk->acks_expected || !term_time_left(tk))
+			continue;
+		start_succession(tk);
 	}
 }
 
+/* With the RTO based timeouts the retries come quicker; keep trying
+ * for as long as the fixed timeout would have, though. */
+static int retries_exhausted(struct ticket_config *tk)
+{
+	timetype now, res;
+
+	if (tk->retry_number <= tk->retries)
+		return 0;
+
+	get_time(&now);
+	time_sub(&now, &tk->req_sent_at, &res);
+	return res.tv_sec >= tk->timeout * tk->retries;
+}
+
 static void handle_resends(struct ticket_config *tk)
 {
 	int ack_cnt;
 
-	if (++tk->retry_number > tk->retries) {
+	++tk->retry_number;
+	if (retries_exhausted(tk)) {
 		tk_log_debug("giving up on sending retries");
 		no_resends(tk);
 		set_ticket_wakeup(tk);
@@ -619,8 +1143,8 @@ static void handle_resends(struct ticket_config *tk)
 		goto just_resend;
 	}
 
-	if (!majority_of_bits(tk, tk->acks_received)) {
-		ack_cnt = count_bits(tk->acks_received) - 1;
+	if (!majority_of_sites(tk, tk->acks_received)) {
+		ack_cnt = siteset_count(tk->acks_received) - 1;
 		if (!ack_cnt) {
 			tk_log_warn("no answers to our request (try #%d), "
 			"we are alone",
@@ -679,6 +1203,20 @@ static void process_next_state(struct ticket_config *tk)
 
 static void ticket_lost(struct ticket_config *tk)
 {
+	time_t acquire_at;
+
+	/* a majority promised us the next term, see start_succession() */
+	if (tk->successor == local && succession_pending(tk) &&
+			tk->successor_term == tk->current_term + 1) {
+		acquire_at = tk->term_expires + tk->acquire_after;
+		if (get_secs(NULL) < acquire_at) {
+			ticket_next_cron_at_coarse(tk, acquire_at);
+			return;
+		}
+		successor_takes_over(tk);
+		return;
+	}
+
 	if (tk->leader != local) {
 		tk_log_warn("lost at %s", site_string(tk->leader));
 	} else {
@@ -690,12 +1228,29 @@ static void ticket_lost(struct ticket_config *tk)
 	tk->state = ST_FOLLOWER;
 	if (local->type == SITE) {
 		ticket_write(tk);
-		schedule_election(tk, OR_TKT_LOST);
+		if (succession_pending(tk)) {
+			/* give the successor a chance to take over first */
+			tk_log_info("waiting for %s to take over",
+					site_string(tk->successor));
+			tk->election_reason = OR_TKT_LOST;
+			ticket_next_cron_at_coarse(tk, tk->successor_until);
+		} else {
+			schedule_election(tk, OR_TKT_LOST);
+		}
 	}
 }
 
 static void next_action(struct ticket_config *tk)
 {
+	/* no majority for a new term (yet), see start_pre_vote() */
+	if (tk->acks_expected == OP_PRE_VOTE_OK) {
+		no_resends(tk);
+		if (!is_owned_elsewhere(tk)) {
+			new_election(tk, NULL, 1, OR_AGAIN);
+			return;
+		}
+	}
+
 	switch(tk->state) {
 	case ST_INIT:
 		/* init state, handle resends for ticket revoke */
@@ -706,6 +1261,16 @@ static void next_action(struct ticket_config *tk)
 		break;
 
 	case ST_FOLLOWER:
+		/* we're handing the ticket over, see start_handover(),
+		 * or asking to take it over, see start_succession() */
+		if (tk->acks_expected &&
+				(tk->last_request == OP_HANDOVER ||
+				 tk->last_request == OP_TAKEOVER ||
+				 tk->last_request == OP_COND_VOTE)) {
+			handle_resends(tk);
+			break;
+		}
+
 		/* leader/ticket lost? and we didn't vote yet */
 		tk_log_debug("leader: %s, voted_for: %s",
 				site_string(tk->leader),
@@ -736,10 +1301,14 @@ static void next_action(struct ticket_config *tk)
 			handle_resends(tk);
 		} else {
 			/* this is ticket renewal, run local test */
-			if (!test_external_prog(tk, 1)) {
-				ticket_broadcast(tk, OP_HEARTBEAT, OP_ACK, RLT_SUCCESS, 0);
-				ticket_activate_timeout(tk);
-			}
+			if (!tk->ext_verifier || handler_cached_ok(tk))
+				renew_ticket(tk);
+			else if (tk->verify_for)
+				/* ticket_verified() continues; but the
+				 * term might run out before. */
+				ticket_next_cron_at_coarse(tk, tk->term_expires);
+			else if (run_handler(tk, VERIFY_RENEW) < 0)
+				ext_prog_failed(tk, 1);
 		}
 		break;
 
@@ -799,14 +1368,21 @@ out:
 void process_tickets(void)
 {
 	struct ticket_config *tk;
-	int i;
+	int i, n;
 	timetype now, last_cron;
 
 	get_time(&now);
 
-	foreach_ticket(i, tk) {
-		if (time_cmp(&tk->next_cron, &now, >))
-			continue;
+	/* Take all due tickets off the heap first; a ticket that gets
+	 * rescheduled to "now" must not be run again in this round. */
+	n = 0;
+	while (timer_heap_len &&
+			!time_cmp(&timer_heap[0].when, &now, >)) {
+		timer_due[n++] = timer_heap_pop();
+	}
+
+	for (i = 0; i < n; i++) {
+		tk = timer_due[i];
 
 		tk_log_debug("ticket cron");
 
@@ -817,6 +1393,13 @@ void process_tickets(void)
 			tk_log_debug("nobody set ticket wakeup");
 			set_ticket_wakeup(tk);
 		}
+
+		if (ticket_idle(tk)) {
+			tk_log_debug("ticket is idle, going dormant");
+			tk->dormant = 1;
+			continue;
+		}
+		timer_heap_insert(tk);
 	}
 }
 
@@ -841,31 +1424,40 @@ void tickets_log_info(void)
 	}
 }
 
+/* Sites ack these only once the new state is in the CIB (see
+ * ack_when_written() in raft.c), which takes much longer than a
+ * plain round trip; keep the two estimates apart. */
+static rtt_kind_t request_rtt_kind(struct ticket_config *tk)
+{
+	return (tk->last_request == OP_UPDATE ||
+			tk->last_request == OP_REVOKE ||
+			tk->last_request == OP_HANDOVER ||
+			tk->last_request == OP_TAKEOVER) ?
+		RTT_COMMIT : RTT_PLAIN;
+}
 
 static void update_acks(
 		struct ticket_config *tk,
-		struct booth_site *sender,
-		struct booth_site *leader,
-		struct boothc_ticket_msg *msg
+		const struct peer_msg *msg
 	       )
 {
-	uint32_t cmd;
-	uint32_t req;
-
-	cmd = ntohl(msg->header.cmd);
-	req = ntohl(msg->header.request);
-	if (req != tk->last_request ||
-			(tk->acks_expected != cmd &&
+	if (msg->request != tk->last_request ||
+			(tk->acks_expected != msg->cmd &&
 			tk->acks_expected != OP_REJECTED))
 		return;
 
-	/* got an ack! */
-	tk->acks_received |= sender->bitmask;
+	/* got an ack! Only the first one to a request that wasn't
+	 * resent tells us the round trip time (Karn). */
+	if (!tk->retry_number &&
+			!siteset_has(tk->acks_received, msg->sender))
+		peer_rtt_sample(msg->sender, request_rtt_kind(tk),
+				&tk->req_sent_at);
+	siteset_add(tk->acks_received, msg->sender);
 
-	if (cmd == OP_HEARTBEAT)
+	if (msg->cmd == OP_HEARTBEAT)
 	tk_log_debug("got ACK from %s, %d/%d agree.",
-			site_string(sender),
-			count_bits(tk->acks_received),
+			site_string(msg->sender),
+			siteset_count(tk->acks_received),
 			booth_conf->site_count);
 
 	if (tk->delay_commit && all_sites_replied(tk)) {
@@ -875,7 +1467,7 @@ static void update_acks(
 	if (all_replied(tk) ||
 			/* we just stepped down, need only one site to start
 			 * elections */
-			(cmd == OP_REQ_VOTE && tk->last_request == OP_VOTE_FOR)) {
+			(msg->cmd == OP_REQ_VOTE && tk->last_request == OP_VOTE_FOR)) {
 		no_resends(tk);
 		tk->start_postpone = 0;
 		set_ticket_wakeup(tk);
@@ -885,11 +1477,18 @@ static void update_acks(
 /* UDP message receiver. */
 int message_recv(struct boothc_ticket_msg *msg, int msglen)
 {
+	return message_recv_tk(msg, msglen, NULL);
+}
+
+/* If the sender gave the ticket by index (see deliver_multi()), we get
+ * it in @tk; else it's looked up by name. */
+int message_recv_tk(struct boothc_ticket_msg *msg, int msglen,
+		struct ticket_config *tk)
+{
+	struct peer_msg pm;
 	uint32_t from;
-	struct booth_site *source;
-	struct ticket_config *tk;
-	struct booth_site *leader;
 	uint32_t leader_u;
+	int rv;
 
 
 	if (check_boothc_header(&msg->header, sizeof(*msg)) < 0 ||
@@ -899,27 +1498,41 @@ int message_recv(struct boothc_ticket_msg *msg, int msglen)
 	}
 
 	from = ntohl(msg->header.from);
-	if (!find_site_by_id(from, &source) || !source) {
+	if (!find_site_by_id(from, &pm.sender) || !pm.sender) {
 		log_error("unknown sender: %08x", from);
 		return -1;
 	}
 
-	if (!check_ticket(msg->ticket.id, &tk)) {
+	if (!tk && !check_ticket(msg->ticket.id, &tk)) {
 		log_warn("got invalid ticket name %s from %s",
-				msg->ticket.id, site_string(source));
+				msg->ticket.id, site_string(pm.sender));
 		return -EINVAL;
 	}
+	ticket_wakeup(tk);
 
 
 	leader_u = ntohl(msg->ticket.leader);
-	if (!find_site_by_id(leader_u, &leader)) {
+	if (!find_site_by_id(leader_u, &pm.leader)) {
 		tk_log_error("message with unknown leader %u received", leader_u);
 		return -EINVAL;
 	}
 
-	update_acks(tk, source, leader, msg);
-
-	return raft_answer(tk, source, leader, msg);
+	/* From here on, only the host-order copy is used. */
+	pm.tk = tk;
+	pm.cmd = ntohl(msg->header.cmd);
+	pm.op = raft_op(pm.cmd);
+	pm.request = ntohl(msg->header.request);
+	pm.options = ntohl(msg->header.options);
+	pm.result = ntohl(msg->header.result);
+	pm.reason = ntohl(msg->header.reason);
+	pm.term = ntohl(msg->ticket.term);
+	pm.term_valid_for = ntohl(msg->ticket.term_valid_for);
+
+	update_acks(tk, &pm);
+
+	rv = raft_answer(&pm);
+	ticket_maybe_sleep(tk);
+	return rv;
 }
 
 
@@ -933,6 +1546,74 @@ static void log_next_wakeup(struct ticket_config *tk)
 		(int)res.tv_sec, (int)msecs(res));
 }
 
+struct ticket_stats ticket_stats;
+
+/* How long to wait for the acks to our last request, in ms.
+ *
+ * We start with the largest RTO of the peers we still wait for (or
+ * the configured timeout, if one of them has no RTT sample yet), and
+ * double it with each resend (RFC 6298, 5.5). Past the configured
+ * timeout only as long as a leader still gets one more try in before
+ * the term runs out, and never past half a term.
+ * Up to a quarter is taken off at random, so that the tickets which
+ * lost the same peer don't all resend at the same time. */
+static int ticket_resend_timeout(struct ticket_config *tk)
+{
+	struct booth_site *n;
+	int i, r, t, base, limit, ceiling, lease_left;
+
+	limit = tk->timeout * 1000;
+	if (!tk->acks_expected)
+		return limit;
+
+	base = 0;
+	foreach_node(i, n) {
+		if (siteset_has(tk->acks_received, n) || n->down)
+			continue;
+		r = peer_rto_ms(n, request_rtt_kind(tk));
+		if (r < 0) {
+			base = limit;
+			break;
+		}
+		base = max(base, r);
+	}
+	if (!base)
+		base = limit;
+	base = max(base, BOOTH_RTO_MIN_MS);
+
+	ceiling = max(limit, tk->term_duration * 1000 / 2);
+	t = base;
+	for (i = 0; i < tk->retry_number && t < ceiling; i++)
+		t *= 2;
+	t = min(t, ceiling);
+
+	if (t > limit && tk->leader == local && tk->term_expires) {
+		lease_left = (tk->term_expires - get_secs(NULL)) * 1000 - limit;
+		if (t > lease_left)
+			t = max(limit, lease_left);
+	}
+
+	if (t > limit && tk->retry_number)
+		/* a fixed timeout would have resent that often */
+		ticket_stats.resends_saved += t / limit - 1;
+
+	return t - cl_rand_from_interval(0, t / 4);
+}
+
+void ticket_activate_timeout(struct ticket_config *tk)
+{
+	timetype tv, delay, now;
+	int ms;
+
+	ms = ticket_resend_timeout(tk);
+	tk_log_debug("activate ticket timeout in %d.%03d",
+			ms / 1000, ms % 1000);
+	time_from_ms(delay, ms);
+	get_time(&now);
+	time_add(&now, &delay, &tv);
+	ticket_next_cron_at(tk, tv);
+}
+
 /* New vote round; §5.2 */
 /* delay the next election start for up to 1s */
 void add_random_delay(struct ticket_config *tk)
@@ -1010,11 +1691,14 @@ void set_ticket_wakeup(struct ticket_config *tk)
 
 void schedule_election(struct ticket_config *tk, cmd_reason_t reason)
 {
+	timetype now;
+
 	if (local->type != SITE)
 		return;
 
 	tk->election_reason = reason;
-	get_time(&tk->next_cron);
+	get_time(&now);
+	ticket_next_cron_at(tk, now);
 	/* introduce a short delay before starting election */
 	add_random_delay(tk);
 }
@@ -1044,40 +1728,42 @@ char *state_to_string(uint32_t state_ho)
 
 
 int send_reject(struct booth_site *dest, struct ticket_config *tk,
-		cmd_result_t code, struct boothc_ticket_msg *in_msg)
+		cmd_result_t code, const struct peer_msg *in_msg)
 {
-	int req = ntohl(in_msg->header.cmd);
+	int req = in_msg->cmd;
 	struct boothc_ticket_msg msg;
 
 	tk_log_debug("sending reject to %s",
 			site_string(dest));
 	init_ticket_msg(&msg, OP_REJECTED, req, code, 0, tk);
-	return booth_udp_send(dest, &msg, sizeof(msg));
+	return booth_udp_queue(dest, &msg);
 }
 
 int send_msg (
 		int cmd,
 		struct ticket_config *current_tk,
 		struct booth_site *dest,
-		struct boothc_ticket_msg *in_msg
+		const struct peer_msg *in_msg
 	       )
 {
 	int req = 0;
 	struct ticket_config *tk = current_tk;
 	struct boothc_ticket_msg msg;
+	int last_valid = 0;
 
 	if (cmd == OP_MY_INDEX) {
-		if (current_tk->state == ST_CANDIDATE &&
-				current_tk->last_valid_tk->current_term) {
-			tk = current_tk->last_valid_tk;
-		}
+		last_valid = tk->state == ST_CANDIDATE &&
+			tk->last_valid.current_term;
 		tk_log_info("sending status to %s",
 				site_string(dest));
 	}
 
 	if (in_msg)
-		req = ntohl(in_msg->header.cmd);
+		req = in_msg->cmd;
 
-	init_ticket_msg(&msg, cmd, req, RLT_SUCCESS, 0, tk);
-	return booth_udp_send(dest, &msg, sizeof(msg));
+	if (last_valid)
+		init_ticket_msg_last_valid(&msg, cmd, req, RLT_SUCCESS, 0, tk);
+	else
+		init_ticket_msg(&msg, cmd, req, RLT_SUCCESS, 0, tk);
+	return booth_udp_queue(dest, &msg);
 }
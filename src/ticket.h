@@ -44,6 +44,8 @@ int revoke_ticket(struct ticket_config *ticket);
 int list_ticket(char **pdata, unsigned int *len);
 
 int message_recv(struct boothc_ticket_msg *msg, int msglen);
+int message_recv_tk(struct boothc_ticket_msg *msg, int msglen,
+		struct ticket_config *tk);
 void reset_ticket(struct ticket_config *tk);
 void update_ticket_state(struct ticket_config *tk, struct booth_site *sender);
 int setup_ticket(void);
@@ -57,24 +59,45 @@ int find_ticket_by_name(const char *ticket, struct ticket_config **found);
 void set_ticket_wakeup(struct ticket_config *tk);
 int postpone_ticket_processing(struct ticket_config *tk);
 
-int test_external_prog(struct ticket_config *tk, int start_election);
+void ticket_verified(struct ticket_config *tk, int for_what, int rv);
 int acquire_ticket(struct ticket_config *tk, cmd_reason_t reason);
 
-int ticket_answer_list(int fd, struct boothc_ticket_msg *msg);
-int ticket_answer_grant(int fd, struct boothc_ticket_msg *msg);
-int ticket_answer_revoke(int fd, struct boothc_ticket_msg *msg);
+int ticket_answer_list(int ci, struct boothc_ticket_msg *msg);
+int ticket_answer_stats(int ci, struct boothc_ticket_msg *msg);
+int ticket_answer_grant(int ci, struct boothc_ticket_msg *msg);
+int ticket_answer_revoke(int ci, struct boothc_ticket_msg *msg);
+int ticket_answer_migrate(int ci, struct boothc_ticket_msg *msg);
 
 int ticket_broadcast_proposed_state(struct ticket_config *tk, cmd_request_t state);
 
 int ticket_write(struct ticket_config *tk);
+void ticket_write_done(struct ticket_config *tk, int rv);
 
 void process_tickets(void);
+int tickets_next_timeout(void);
+void ticket_timer_update(struct ticket_config *tk);
 void tickets_log_info(void);
+void tickets_peer_up(struct booth_site *site);
+void tickets_peer_down(struct booth_site *site);
+
+/** Daemon-wide counters, see 'booth stats'. */
+struct ticket_stats {
+	/** Resends that went out */
+	unsigned long resends;
+	/** Resends a fixed timeout would have sent, but we didn't
+	 * (because of the backoff, or because the peer was down) */
+	unsigned long resends_saved;
+	/** Elections we stood in that ended with a leader, and the
+	 * rounds they took */
+	unsigned long elections;
+	unsigned long election_rounds;
+};
+extern struct ticket_stats ticket_stats;
 char *state_to_string(uint32_t state_ho);
 int send_reject(struct booth_site *dest, struct ticket_config *tk,
-	cmd_result_t code, struct boothc_ticket_msg *in_msg);
+	cmd_result_t code, const struct peer_msg *in_msg);
 int send_msg (int cmd, struct ticket_config *tk,
-	struct booth_site *dest, struct boothc_ticket_msg *in_msg);
+	struct booth_site *dest, const struct peer_msg *in_msg);
 int ticket_broadcast(struct ticket_config *tk, cmd_request_t cmd, cmd_request_t expected_reply, cmd_result_t res, cmd_reason_t reason);
 
 int leader_update_ticket(struct ticket_config *tk);
@@ -84,12 +107,14 @@ void schedule_election(struct ticket_config *tk, cmd_reason_t reason);
 static inline void ticket_next_cron_at(struct ticket_config *tk, timetype when)
 {
 	tk->next_cron = when;
+	ticket_timer_update(tk);
 }
 
 static inline void ticket_next_cron_at_coarse(struct ticket_config *tk, time_t when)
 {
 	memset(&tk->next_cron, 0, sizeof(tk->next_cron));
 	tk->next_cron.tv_sec  = when;
+	ticket_timer_update(tk);
 }
 
 static inline void ticket_next_cron_in(struct ticket_config *tk, time_t seconds)
@@ -102,13 +127,7 @@ static inline void ticket_next_cron_in(struct ticket_config *tk, time_t seconds)
 	ticket_next_cron_at(tk, tv);
 }
 
-
-static inline void ticket_activate_timeout(struct ticket_config *tk)
-{
-	/* TODO: increase timeout when no answers */
-	tk_log_debug("activate ticket timeout in %d", tk->timeout);
-	ticket_next_cron_in(tk, tk->timeout);
-}
+void ticket_activate_timeout(struct ticket_config *tk);
 
 
 #endif /* _TICKET_H */
@@ -47,6 +47,12 @@ time_t wall_ts(time_t t);
 time_t unwall_ts(time_t t);
 
 #define msecs(tv) ((tv).tv_nsec/1000000)
+#define usecs(tv) ((tv).tv_nsec/1000)
+
+#define time_from_ms(tv, ms) do { \
+	(tv).tv_sec = (ms) / 1000; \
+	(tv).tv_nsec = ((ms) % 1000) * 1000000; \
+	} while(0)
 
 /* random time from 0 to t milliseconds */
 #define rand_time_ms(tv, t) do { \
@@ -64,6 +70,12 @@ typedef struct timeval timetype;
 #define get_secs time
 
 #define msecs(tv) ((tv).tv_usec/1000)
+#define usecs(tv) ((tv).tv_usec)
+
+#define time_from_ms(tv, ms) do { \
+	(tv).tv_sec = (ms) / 1000; \
+	(tv).tv_usec = ((ms) % 1000) * 1000; \
+	} while(0)
 
 /* random time from 0 to t milliseconds */
 #define rand_time_ms(tv, t) do { \
@@ -17,6 +17,7 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <net/if.h>
@@ -40,8 +41,13 @@
 #define BOOTH_IPADDR_LEN	(sizeof(struct in6_addr))
 
 #define NETLINK_BUFSIZE		16384
-#define SOCKET_BUFFER_SIZE	160000
 #define FRAME_SIZE_MAX		10000
+#define TCP_LISTEN_BACKLOG	128
+
+/* Datagrams per recvmmsg()/sendmmsg() call */
+#define UDP_BATCH		16
+/* Batches to read per wakeup; then the timers get their turn. */
+#define UDP_RECV_ROUNDS		8
 
 
 
@@ -51,6 +57,47 @@ struct booth_site *local = NULL;
 static int (*deliver_fn) (void *msg, int msglen);
 
 
+/* Records that fit into one BOOTHC_VERSION_MULTI packet. */
+#define MULTI_RECS_MAX \
+	((BOOTH_UDP_MAX_LEN - sizeof(struct boothc_header)) / \
+	 sizeof(struct boothc_multi_rec))
+#define MULTI_ID_RECS_MAX \
+	((BOOTH_UDP_MAX_LEN - sizeof(struct boothc_header)) / \
+	 sizeof(struct boothc_multi_id_rec))
+
+/** Messages to a peer, sent at the end of the main loop iteration
+ * (or when full), see booth_udp_queue(). */
+struct udp_outbox {
+	/** We got something from the peer since we started */
+	int seen;
+	/** When the unanswered OP_PING went out, if any */
+	timetype ping_sent;
+	/** OP_PINGs sent before we heard anything from the peer */
+	int probes_unseen;
+	/** The peer can receive BOOTHC_VERSION_MULTI */
+	int multi;
+	/** ... and has the same tickets, see struct boothc_multi_rec */
+	int same_tickets;
+	int count;
+	struct boothc_ticket_msg msgs[MULTI_ID_RECS_MAX];
+	/** Index of the ticket, -1 if not known */
+	int ids[MULTI_ID_RECS_MAX];
+};
+
+/** Indexed by booth_site.index */
+static struct udp_outbox *outbox;
+static int outbox_pending;
+
+/** Datagrams ready for sendmmsg(), see udp_send_add(). */
+static struct {
+	int count;
+	struct booth_site *to[UDP_BATCH];
+	struct mmsghdr hdr[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	char buf[UDP_BATCH][BOOTH_UDP_MAX_LEN];
+} sendq;
+
+
 static void parse_rtattr(struct rtattr *tb[],
 			 int max, struct rtattr *rta, int len)
 {
@@ -303,22 +350,38 @@ int check_boothc_header(struct boothc_header *h, int len_incl_data)
 static void process_tcp_listener(int ci)
 {
 	int fd, i, one = 1;
-	socklen_t addrlen = sizeof(struct sockaddr);
-	struct sockaddr addr;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
 
-	fd = accept(clients[ci].fd, &addr, &addrlen);
-	if (fd < 0) {
-		log_error("process_tcp_listener: accept error %d %d",
-			  fd, errno);
-		return;
-	}
-	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+	/* The listener is non-blocking; take all pending connections. */
+	while (1) {
+		addrlen = sizeof(addr);
+		fd = accept4(clients[ci].fd, (struct sockaddr *)&addr, &addrlen,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log_error("process_tcp_listener: accept error %d %d",
+						fd, errno);
+			return;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
 
 
-	i = client_add(fd, clients[ci].transport,
-			process_connection, NULL);
+		i = client_add(fd, clients[ci].transport,
+				process_connection, NULL);
+		if (i < 0) {
+			close(fd);
+			continue;
+		}
+		if (client_conn_start(i) < 0) {
+			clients[i].deadfn(i);
+			continue;
+		}
 
-	log_debug("client connection %d fd %d", i, fd);
+		log_debug("client connection %d fd %d", i, fd);
+	}
 }
 
 int setup_tcp_listener(int test_only)
@@ -350,12 +413,18 @@ int setup_tcp_listener(int test_only)
 		return rv;
 	}
 
-	rv = listen(s, 5);
+	rv = listen(s, TCP_LISTEN_BACKLOG);
 	if (rv == -1) {
 		log_error("failed to listen on socket %s", strerror(errno));
 		return rv;
 	}
 
+	rv = fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	if (rv == -1) {
+		log_error("failed to set non-blocking mode %s", strerror(errno));
+		return rv;
+	}
+
 	return s;
 }
 
@@ -501,7 +570,7 @@ static int setup_udp_server(void)
 {
 	int rv, fd;
 	int one = 1;
-	unsigned int recvbuf_size;
+	unsigned int buf_size;
 
 	fd = socket(local->family, SOCK_DGRAM, 0);
 	if (fd == -1) {
@@ -531,14 +600,22 @@ static int setup_udp_server(void)
 		goto ex;
 	}
 
-	recvbuf_size = SOCKET_BUFFER_SIZE;
+	buf_size = booth_conf->udp_buffer_size;
 	rv = setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
-			&recvbuf_size, sizeof(recvbuf_size));
+			&buf_size, sizeof(buf_size));
 	if (rv == -1) {
 		log_error("failed to set recvbuf size");
 		goto ex;
 	}
 
+	/* A flush can send a packet to every peer at once. */
+	rv = setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+			&buf_size, sizeof(buf_size));
+	if (rv == -1) {
+		log_error("failed to set sendbuf size");
+		goto ex;
+	}
+
 	local->udp_fd = fd;
 	return 0;
 
@@ -549,37 +626,288 @@ ex:
 }
 
 
-/* Receive/process callback for UDP */
-static void process_recv(int ci)
+/* Remember whether the peer can take multi-record packets.
+ * Every packet from a current peer says so; an older one never does,
+ * so a downgrade is noticed as well. */
+static void note_peer_proto(struct booth_site *site, struct boothc_header *h)
 {
-	struct sockaddr_storage sa;
-	int rv;
-	socklen_t sa_len;
-	char buffer[256];
-	/* Used for unit tests */
-	struct boothc_ticket_msg *msg;
+	int multi, same;
+
+	if (!outbox)
+		return;
+
+	outbox[site->index].seen = 1;
+	multi = h->version == htonl(BOOTHC_VERSION_MULTI) ||
+		(ntohl(h->options) & OPT_MULTI_RECORD);
+	if (outbox[site->index].multi != multi) {
+		log_info("%s %s multi-record packets",
+				site_string(site),
+				multi ? "accepts" : "doesn't accept");
+		outbox[site->index].multi = multi;
+	}
+
+	/* Only multi-record packets tell about the tickets. */
+	if (h->version != htonl(BOOTHC_VERSION_MULTI))
+		return;
+
+	same = ntohl(h->request) == booth_conf->ticket_list_hash;
+	if (outbox[site->index].same_tickets != same) {
+		log_info("%s has %s tickets; referring to them by %s",
+				site_string(site),
+				same ? "the same" : "different",
+				same ? "index" : "name");
+		outbox[site->index].same_tickets = same;
+	}
+}
+
+/* Records with ticket indices go straight to message_recv_tk(). */
+static void deliver_multi_ids(struct boothc_header *h, int len)
+{
+	struct boothc_multi_id_rec *rec;
+	struct boothc_ticket_msg msg;
+	struct ticket_config *tk;
+	uint32_t id;
+	int i, count;
+
+	count = (len - (int)sizeof(*h)) / (int)sizeof(*rec);
+	if (count < 1 || sizeof(*h) + count * sizeof(*rec) != len) {
+		log_error("multi-record packet with bad length %d", len);
+		return;
+	}
+
+	if (ntohl(h->request) != booth_conf->ticket_list_hash) {
+		/* The sender will learn from our next packet. */
+		log_error("got ticket indices from a peer "
+				"with other tickets, ignoring");
+		return;
+	}
+
+	memset(&msg.ticket, 0, sizeof(msg.ticket));
+	msg.header = *h;
+	msg.header.version = htonl(BOOTHC_VERSION);
+	msg.header.length = htonl(sizeof(msg));
+	rec = (void*)h->data;
+	for (i = 0; i < count; i++, rec++) {
+		id = ntohl(rec->ticket);
+		if (id >= booth_conf->ticket_count) {
+			log_error("got invalid ticket index %u", id);
+			continue;
+		}
+		tk = booth_conf->ticket + id;
+
+		msg.header.cmd     = rec->cmd;
+		msg.header.request = rec->request;
+		msg.header.options = rec->options;
+		msg.header.reason  = rec->reason;
+		msg.header.result  = rec->result;
+		msg.ticket.leader  = rec->leader;
+		msg.ticket.term    = rec->term;
+		msg.ticket.term_valid_for = rec->term_valid_for;
+		message_recv_tk(&msg, sizeof(msg), tk);
+	}
+}
+
+/* Hand the records of a multi-record packet on one by one,
+ * each as a complete single-ticket message. */
+static void deliver_multi(struct boothc_header *h, int len)
+{
+	struct boothc_multi_rec *rec;
+	struct boothc_ticket_msg msg;
+	int i, count;
 
+	if (ntohl(h->length) != len) {
+		log_error("multi-record packet with bad length %d", len);
+		return;
+	}
 
-	sa_len = sizeof(sa);
-	msg = (void*)buffer;
-	rv = recvfrom(clients[ci].fd,
-			buffer, sizeof(buffer),
-			MSG_NOSIGNAL | MSG_DONTWAIT,
-			(struct sockaddr *)&sa, &sa_len);
-	if (rv == -1)
+	if (ntohl(h->options) & OPT_TICKET_IDS) {
+		deliver_multi_ids(h, len);
+		return;
+	}
+
+	count = (len - (int)sizeof(*h)) / (int)sizeof(*rec);
+	if (count < 1 || sizeof(*h) + count * sizeof(*rec) != len) {
+		log_error("multi-record packet with bad length %d", len);
+		return;
+	}
+
+	msg.header = *h;
+	msg.header.version = htonl(BOOTHC_VERSION);
+	msg.header.length = htonl(sizeof(msg));
+	rec = (void*)h->data;
+	for (i = 0; i < count; i++, rec++) {
+		msg.header.cmd     = rec->cmd;
+		msg.header.request = rec->request;
+		msg.header.options = rec->options;
+		msg.header.reason  = rec->reason;
+		msg.header.result  = rec->result;
+		msg.ticket = rec->ticket;
+		deliver_fn(&msg, sizeof(msg));
+	}
+}
+
+/* Site probes are sent right away, not via sendq: they are not ticket
+ * messages (and the unit tests only want to see those). */
+static void send_probe(struct booth_site *to, cmd_request_t cmd)
+{
+	struct boothc_header h;
+
+	/* Like all BOOTHC_VERSION_MULTI packets, tells about our
+	 * tickets; see note_peer_proto(). */
+	init_header(&h, cmd, booth_conf->ticket_list_hash, OPT_MULTI_RECORD,
+			0, 0, sizeof(h));
+	h.version = htonl(BOOTHC_VERSION_MULTI);
+	booth_udp_send(to, &h, sizeof(h));
+}
+
+/* One round trip to @site took from @sent until now; keep the
+ * smoothed RTT and its variation like RFC 6298 does. */
+void peer_rtt_sample(struct booth_site *site, rtt_kind_t kind,
+		timetype *sent)
+{
+	timetype now, res;
+	int r;
+
+	get_time(&now);
+	time_sub(&now, sent, &res);
+	r = res.tv_sec * 1000000 + usecs(res);
+	if (r <= 0)
+		r = 1;
+
+	if (!site->srtt[kind]) {
+		site->srtt[kind] = r;
+		site->rttvar[kind] = r / 2;
+	} else {
+		site->rttvar[kind] = (3 * site->rttvar[kind] +
+				abs(site->srtt[kind] - r)) / 4;
+		site->srtt[kind] = (7 * site->srtt[kind] + r) / 8;
+	}
+}
+
+/* Retransmission timeout for @site in milliseconds (RFC 6298, with
+ * a clock granularity of 1ms), or -1 if there's no RTT sample yet. */
+int peer_rto_ms(struct booth_site *site, rtt_kind_t kind)
+{
+	if (!site->srtt[kind])
+		return -1;
+	return (site->srtt[kind] + max(1000, 4 * site->rttvar[kind]) +
+			999) / 1000;
+}
+
+/* Any packet from a peer shows that it is alive. */
+static void peer_heard(struct booth_site *site)
+{
+	site->last_recv = get_secs(NULL);
+	if (!site->down)
 		return;
 
-	deliver_fn(msg, rv);
+	site->down = 0;
+	log_info("%s %s is reachable again",
+			(site->type == ARBITRATOR ? "arbitrator" : "site"),
+			site_string(site));
+	tickets_peer_up(site);
+}
+
+/* Whether @site runs an older booth, as far as we can tell: it
+ * talked to us, but never about multi-record packets. */
+int peer_is_old(struct booth_site *site)
+{
+	return outbox && outbox[site->index].seen &&
+		!outbox[site->index].multi;
+}
+
+/* Peers known to run an older booth don't answer probes; we never
+ * take them as down. */
+static int peer_probed(struct booth_site *site)
+{
+	return site != local && outbox && !peer_is_old(site);
+}
+
+/* One received datagram; the unit tests change it here. */
+static void deliver_datagram(struct boothc_ticket_msg *msg, int len)
+{
+	struct boothc_header *h = &msg->header;
+	struct booth_site *site;
+
+	if (len >= sizeof(*h) && h->magic == htonl(BOOTHC_MAGIC)) {
+		if (!find_site_by_id(ntohl(h->from), &site) || site == local)
+			site = NULL;
+		if (site) {
+			note_peer_proto(site, h);
+			peer_heard(site);
+		}
+
+		if (h->version == htonl(BOOTHC_VERSION_MULTI)) {
+			if (h->cmd == htonl(OP_PING)) {
+				if (site)
+					send_probe(site, OP_PONG);
+			} else if (h->cmd == htonl(OP_PONG)) {
+				if (site && outbox[site->index].ping_sent.tv_sec) {
+					peer_rtt_sample(site, RTT_PLAIN,
+							&outbox[site->index].ping_sent);
+					outbox[site->index].ping_sent.tv_sec = 0;
+				}
+			} else {
+				deliver_multi(h, len);
+			}
+			return;
+		}
+	}
+
+	deliver_fn(msg, len);
+}
+
+/* Receive/process callback for UDP.
+ * Reads up to UDP_RECV_ROUNDS batches; if there is still more, the
+ * socket stays readable and we get called again after the timers. */
+static void process_recv(int ci)
+{
+	static char buffer[UDP_BATCH][BOOTH_UDP_MAX_LEN];
+	struct mmsghdr hdr[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	int i, n, round;
+
+	for (round = 0; round < UDP_RECV_ROUNDS; round++) {
+		memset(hdr, 0, sizeof(hdr));
+		for (i = 0; i < UDP_BATCH; i++) {
+			iov[i].iov_base = buffer[i];
+			iov[i].iov_len = sizeof(buffer[i]);
+			hdr[i].msg_hdr.msg_iov = iov + i;
+			hdr[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		n = recvmmsg(clients[ci].fd, hdr, UDP_BATCH,
+				MSG_DONTWAIT, NULL);
+		if (n <= 0)
+			return;
+
+		for (i = 0; i < n; i++)
+			deliver_datagram((void*)buffer[i], hdr[i].msg_len);
+
+		if (n < UDP_BATCH)
+			return;
+	}
 }
 
 static int booth_udp_init(void *f)
 {
-	int rv;
+	struct booth_site *site;
+	int i, rv;
 
 	rv = setup_udp_server();
 	if (rv < 0)
 		return rv;
 
+	outbox = calloc(booth_conf->site_count, sizeof(*outbox));
+	if (!outbox) {
+		log_error("can't alloc UDP outboxes");
+		return -ENOMEM;
+	}
+
+	/* Give the peers some time before taking them as down. */
+	foreach_node(i, site)
+		site->last_recv = get_secs(NULL);
+
 	deliver_fn = f;
 	client_add(local->udp_fd,
 			booth_transport + UDP,
@@ -598,10 +926,11 @@ int booth_udp_send(struct booth_site *to, void *buf, int len)
 		rv = 0;
 	} else if (rv < 0) {
 		rv = errno;
-		log_error("Cannot send to %s: %d %s",
-				site_string(to),
-				errno,
-				strerror(errno));
+		if (!to->down)
+			log_error("Cannot send to %s: %d %s",
+					site_string(to),
+					errno,
+					strerror(errno));
 	} else {
 		rv = EBUSY;
 		log_error("Packet sent to %s got truncated",
@@ -611,6 +940,281 @@ int booth_udp_send(struct booth_site *to, void *buf, int len)
 	return rv;
 }
 
+/* Send what's in sendq. Datagrams that fail are lost, like with any
+ * other UDP packet. */
+static void udp_send_flush(void)
+{
+	int rv, done;
+
+	done = 0;
+	while (done < sendq.count) {
+		rv = sendmmsg(local->udp_fd, sendq.hdr + done,
+				sendq.count - done, MSG_NOSIGNAL);
+		if (rv < 0 && errno == EINTR)
+			continue;
+
+		if (rv <= 0) {
+			/* The first one didn't go out; skip it. */
+			if (!sendq.to[done]->down)
+				log_error("Cannot send to %s: %d %s",
+						site_string(sendq.to[done]),
+						errno, strerror(errno));
+			rv = 1;
+		}
+		done += rv;
+	}
+
+	sendq.count = 0;
+}
+
+/* Queue one datagram for sendmmsg().
+ * (The unit tests look at the outgoing packets here.) */
+static void udp_send_add(struct booth_site *to, void *buf, int len)
+{
+	struct mmsghdr *m;
+	int i;
+
+	if (sendq.count == UDP_BATCH)
+		udp_send_flush();
+
+	i = sendq.count++;
+	memcpy(sendq.buf[i], buf, len);
+	sendq.to[i] = to;
+	sendq.iov[i].iov_base = sendq.buf[i];
+	sendq.iov[i].iov_len = len;
+	m = sendq.hdr + i;
+	memset(m, 0, sizeof(*m));
+	m->msg_hdr.msg_name = &to->sa6;
+	m->msg_hdr.msg_namelen = to->saddrlen;
+	m->msg_hdr.msg_iov = sendq.iov + i;
+	m->msg_hdr.msg_iovlen = 1;
+}
+
+/* Pack @n records starting at @first into @buf, by ticket index if
+ * @by_id; returns the packet length. */
+static int multi_pack(char *buf, struct udp_outbox *ob, int first, int n,
+		int by_id)
+{
+	struct boothc_header *h;
+	struct boothc_multi_rec *rec;
+	struct boothc_multi_id_rec *id_rec;
+	struct boothc_ticket_msg *msg;
+	int i, len;
+
+	len = sizeof(*h) + n * (by_id ? sizeof(*id_rec) : sizeof(*rec));
+	h = (void*)buf;
+	init_header(h, 0, booth_conf->ticket_list_hash,
+			by_id ? OPT_TICKET_IDS : 0, 0, 0, len);
+	h->version = htonl(BOOTHC_VERSION_MULTI);
+
+	rec = (void*)h->data;
+	id_rec = (void*)h->data;
+	for (i = first; i < first + n; i++) {
+		msg = ob->msgs + i;
+		if (by_id) {
+			id_rec->cmd     = msg->header.cmd;
+			id_rec->request = msg->header.request;
+			id_rec->options = msg->header.options;
+			id_rec->reason  = msg->header.reason;
+			id_rec->result  = msg->header.result;
+			id_rec->ticket  = htonl(ob->ids[i]);
+			id_rec->leader  = msg->ticket.leader;
+			id_rec->term    = msg->ticket.term;
+			id_rec->term_valid_for = msg->ticket.term_valid_for;
+			id_rec++;
+		} else {
+			rec->cmd     = msg->header.cmd;
+			rec->request = msg->header.request;
+			rec->options = msg->header.options;
+			rec->reason  = msg->header.reason;
+			rec->result  = msg->header.result;
+			rec->ticket  = msg->ticket;
+			rec++;
+		}
+	}
+	return len;
+}
+
+static void outbox_flush(struct booth_site *to, struct udp_outbox *ob)
+{
+	char buf[BOOTH_UDP_MAX_LEN];
+	struct boothc_ticket_msg *msg;
+	int i, n, len, by_id;
+
+	if (ob->multi && ob->count > 1) {
+		by_id = ob->same_tickets;
+		for (i = 0; by_id && i < ob->count; i++)
+			by_id = ob->ids[i] >= 0;
+
+		for (i = 0; i < ob->count; i += n) {
+			n = ob->count - i;
+			if (!by_id && n > MULTI_RECS_MAX)
+				n = MULTI_RECS_MAX;
+			len = multi_pack(buf, ob, i, n, by_id);
+			udp_send_add(to, buf, len);
+		}
+	} else {
+		/* Old peers see the option, but ignore it. */
+		for (i = 0; i < ob->count; i++) {
+			msg = ob->msgs + i;
+			msg->header.options |= htonl(OPT_MULTI_RECORD);
+			udp_send_add(to, msg, sizeof(*msg));
+		}
+	}
+
+	ob->count = 0;
+}
+
+/** Queue a message to a peer; booth_udp_flush() sends it, together
+ * with everything else that is due to the same peer. */
+int booth_udp_queue(struct booth_site *to, struct boothc_ticket_msg *msg)
+{
+	struct udp_outbox *ob;
+
+	if (!outbox)
+		return booth_udp_send(to, msg, sizeof(*msg));
+
+	ob = outbox + to->index;
+	if (ob->count == MULTI_ID_RECS_MAX)
+		outbox_flush(to, ob);
+
+	ob->ids[ob->count] = ticket_hash_find((char *)msg->ticket.id);
+	ob->msgs[ob->count++] = *msg;
+	outbox_pending = 1;
+	return 0;
+}
+
+void booth_udp_flush(void)
+{
+	int i;
+	struct booth_site *site;
+
+	if (!outbox_pending)
+		return;
+
+	foreach_node(i, site) {
+		if (outbox[i].count)
+			outbox_flush(site, outbox + i);
+	}
+	udp_send_flush();
+	outbox_pending = 0;
+}
+
+/* Probe the peers that have been quiet for a while, and take those
+ * that stay silent as down; the tickets then stop resending to them
+ * (see resend_msg()) until they are heard from again. */
+void process_peer_timeouts(void)
+{
+	struct booth_site *site;
+	time_t now;
+	int i;
+
+	now = get_secs(NULL);
+	foreach_node(i, site) {
+		if (!peer_probed(site))
+			continue;
+
+		if (now - max(site->last_recv, site->last_probe) >=
+				PEER_PROBE_INTERVAL) {
+			site->last_probe = now;
+			if (outbox[i].seen ||
+					outbox[i].probes_unseen < PEER_PROBES_UNSEEN) {
+				send_probe(site, OP_PING);
+				get_time(&outbox[i].ping_sent);
+				if (!outbox[i].seen)
+					outbox[i].probes_unseen++;
+			}
+		}
+
+		if (!site->down &&
+				now - site->last_recv >= PEER_DOWN_AFTER &&
+				site->last_probe > site->last_recv) {
+			site->down = 1;
+			log_warn("%s %s is not reachable, "
+					"holding back ticket retries",
+					(site->type == ARBITRATOR ? "arbitrator" : "site"),
+					site_string(site));
+			tickets_peer_down(site);
+		}
+	}
+}
+
+/* Milliseconds until process_peer_timeouts() has something to do,
+ * or -1. */
+int peers_next_timeout(void)
+{
+	struct booth_site *site;
+	time_t now, next, due;
+	int i;
+
+	next = 0;
+	foreach_node(i, site) {
+		if (!peer_probed(site))
+			continue;
+
+		due = max(site->last_recv, site->last_probe) +
+			PEER_PROBE_INTERVAL;
+		if (!site->down)
+			due = min(due, site->last_recv + PEER_DOWN_AFTER);
+		if (!next || due < next)
+			next = due;
+	}
+
+	if (!next)
+		return -1;
+	now = get_secs(NULL);
+	return next > now ? (next - now) * 1000 : 0;
+}
+
+int peers_answer_list(int ci, struct boothc_ticket_msg *msg)
+{
+	struct booth_site *site;
+	struct boothc_header hdr;
+	char *data, *cp;
+	time_t now;
+	int i, alloc, rv;
+
+	alloc = booth_conf->site_count * (BOOTH_NAME_LEN + 128);
+	data = malloc(alloc);
+	if (!data)
+		return -ENOMEM;
+
+	now = get_secs(NULL);
+	cp = data;
+	foreach_node(i, site) {
+		cp += snprintf(cp, alloc - (cp - data),
+				"site: %s, type: %s, state: ",
+				site_string(site),
+				(site->type == ARBITRATOR ? "arbitrator" : "site"));
+
+		if (site == local)
+			cp += snprintf(cp, alloc - (cp - data), "local\n");
+		else if (!outbox || !outbox[site->index].seen)
+			cp += snprintf(cp, alloc - (cp - data), "%s, never heard\n",
+					site->down ? "down" : "unknown");
+		else if (!site->srtt[RTT_PLAIN])
+			cp += snprintf(cp, alloc - (cp - data),
+					"%s, last heard %ds ago\n",
+					site->down ? "down" : "up",
+					(int)(now - site->last_recv));
+		else
+			cp += snprintf(cp, alloc - (cp - data),
+					"%s, last heard %ds ago, "
+					"rtt %d.%03dms, rto %dms\n",
+					site->down ? "down" : "up",
+					(int)(now - site->last_recv),
+					site->srtt[RTT_PLAIN] / 1000,
+					site->srtt[RTT_PLAIN] % 1000,
+					peer_rto_ms(site, RTT_PLAIN));
+	}
+
+	init_header(&hdr, CMR_PEERS, 0, 0, RLT_SUCCESS, 0,
+			sizeof(hdr) + (cp - data));
+	rv = send_header_plus(ci, &hdr, data, cp - data);
+	free(data);
+	return rv;
+}
+
 static int booth_udp_broadcast(void *buf, int len)
 {
 	int i, rv, rvs;
@@ -620,10 +1224,12 @@ static int booth_udp_broadcast(void *buf, int len)
 	if (!booth_conf || !booth_conf->site_count)
 		return -1;
 
+	assert(len == sizeof(struct boothc_ticket_msg));
+
 	rvs = 0;
 	foreach_node(i, site) {
 		if (site != local) {
-			rv = booth_udp_send(site, buf, len);
+			rv = booth_udp_queue(site, buf);
 			if (!rvs)
 				rvs = rv;
 		}
@@ -634,6 +1240,7 @@ static int booth_udp_broadcast(void *buf, int len)
 
 static int booth_udp_exit(void)
 {
+	booth_udp_flush();
 	return 0;
 }
 
@@ -698,27 +1305,21 @@ const struct booth_transport *local_transport = booth_transport+TCP;
 
 
 
-int send_header_only(int fd, struct boothc_header *hdr)
+/* These queue the answer on a client connection;
+ * see process_connection(). */
+int send_header_only(int ci, struct boothc_header *hdr)
 {
-	int rv;
-
-	rv = do_write(fd, hdr, sizeof(*hdr));
-
-	return rv;
+	return client_send(ci, hdr, sizeof(*hdr));
 }
 
 
-int send_ticket_msg(int fd, struct boothc_ticket_msg *msg)
+int send_ticket_msg(int ci, struct boothc_ticket_msg *msg)
 {
-	int rv;
-
-	rv = do_write(fd, msg, sizeof(*msg));
-
-	return rv;
+	return client_send(ci, msg, sizeof(*msg));
 }
 
 
-int send_header_plus(int fd, struct boothc_header *hdr, void *data, int len)
+int send_header_plus(int ci, struct boothc_header *hdr, void *data, int len)
 {
 	int rv;
 	int l;
@@ -728,13 +1329,13 @@ int send_header_plus(int fd, struct boothc_header *hdr, void *data, int len)
 		assert(l == ntohl(hdr->length));
 
 		/* One struct */
-		rv = do_write(fd, hdr, l);
+		rv = client_send(ci, hdr, l);
 	} else {
 		/* Header and data in two locations */
-		rv = send_header_only(fd, hdr);
+		rv = send_header_only(ci, hdr);
 
 		if (rv >= 0 && len)
-			rv = do_write(fd, data, len);
+			rv = client_send(ci, data, len);
 	}
 
 	return rv;
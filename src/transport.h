@@ -21,6 +21,7 @@
 #define _TRANSPORT_H
 
 #include "booth.h"
+#include "timer.h"
 
 typedef enum {
 	TCP = 1,
@@ -55,6 +56,15 @@ int check_boothc_header(struct boothc_header *data, int len_incl_data);
 
 int setup_tcp_listener(int test_only);
 int booth_udp_send(struct booth_site *to, void *buf, int len);
+int booth_udp_queue(struct booth_site *to, struct boothc_ticket_msg *msg);
+void booth_udp_flush(void);
+void process_peer_timeouts(void);
+int peers_next_timeout(void);
+void peer_rtt_sample(struct booth_site *site, rtt_kind_t kind,
+		timetype *sent);
+int peer_rto_ms(struct booth_site *site, rtt_kind_t kind);
+int peer_is_old(struct booth_site *site);
+int peers_answer_list(int ci, struct boothc_ticket_msg *msg);
 
 int booth_tcp_open(struct booth_site *to);
 int booth_tcp_send(struct booth_site *to, void *buf, int len);
@@ -69,9 +79,9 @@ inline static void * node_to_addr_pointer(struct booth_site *node) {
 
 extern const struct booth_transport *local_transport;
 
-int send_header_only(int fd, struct boothc_header *hdr);
-int send_header_plus(int fd, struct boothc_header *hdr, void *data, int len);
-int send_ticket_msg(int fd, struct boothc_ticket_msg *msg);
+int send_header_only(int ci, struct boothc_header *hdr);
+int send_header_plus(int ci, struct boothc_header *hdr, void *data, int len);
+int send_ticket_msg(int ci, struct boothc_ticket_msg *msg);
 
 
 #endif /* _TRANSPORT_H */